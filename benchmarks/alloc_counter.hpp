@@ -0,0 +1,33 @@
+#include <cstdlib>
+#include <new>
+#include <atomic>
+
+/* Counts heap allocations and allocated bytes of the whole benchmark, included once by each of them */
+static std::atomic<unsigned long long> allocations(0);
+static std::atomic<unsigned long long> allocated_bytes(0);
+
+/* Out of line, so GCC doesn't match the inlined malloc and free against the standard new and delete */
+__attribute__((noinline)) void *operator new(size_t size)
+{
+	allocations++;
+	allocated_bytes += size;
+	void *p = std::malloc(size ? size : 1);
+	if (!p) throw std::bad_alloc();
+	return p;
+}
+__attribute__((noinline)) void operator delete(void *p) noexcept
+{
+	std::free(p);
+}
+__attribute__((noinline)) void operator delete(void *p, size_t) noexcept
+{
+	std::free(p);
+}
+__attribute__((noinline)) void operator delete[](void *p) noexcept
+{
+	std::free(p);
+}
+__attribute__((noinline)) void operator delete[](void *p, size_t) noexcept
+{
+	std::free(p);
+}
@@ -0,0 +1,138 @@
+#include "telegrab.hpp"
+
+#include "alloc_counter.hpp"
+
+void Telegrab::Instructions(Update)
+{
+}
+
+static volatile size_t sink;
+
+/* The same conversion a byte at a time, to compare with */
+static void naive(const char *text, size_t size, size_t *positions, size_t count)
+{
+	size_t i = 0, units = 0;
+	for (size_t p = 0; p < count; p++)
+	{
+		for (; i < size; i++)
+		{
+			unsigned char c = text[i];
+			if ((c & 0xC0) == 0x80) continue;
+			if (units >= positions[p]) break;
+			units += c >= 0xF0 ? 2 : 1;
+		}
+		positions[p] = i;
+	}
+}
+
+/* Text of about 'size' bytes made of the given words, and its length in UTF-16 code units */
+static std::string makeText(const std::vector<std::string> &words, size_t size, size_t &units)
+{
+	std::string text;
+	units = 0;
+	for (size_t i = 0; text.size() < size; i++)
+	{
+		const std::string &word = words[i * 7919 % words.size()];
+		text += word;
+		for (unsigned char c:word)
+		{
+			if ((c & 0xC0) != 0x80) units += c >= 0xF0 ? 2 : 1;
+		}
+	}
+	return text;
+}
+
+static void convert(const char *name, const std::string &text, size_t units, size_t step, void (*function)(const char*, size_t, size_t*, size_t))
+{
+	std::vector<size_t> positions, scratch;
+	for (size_t unit = step; unit <= units; unit += step) positions.push_back(unit);
+	if (positions.empty() || positions.back() != units) positions.push_back(units);
+
+	unsigned int iterations = 0;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	double seconds = 0;
+	do
+	{
+		scratch = positions;
+		function(text.data(), text.size(), scratch.data(), scratch.size());
+		sink += scratch.back();
+		iterations++;
+		seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+	while (seconds < 0.3);
+	std::cout << name << ": " << (text.size() * (double)iterations / seconds / 1048576) << " MB/s" << std::endl;
+}
+
+/* getUpdates response with one message of the given text and an entity on every 'step'-th word */
+static std::shared_ptr<nlohmann::json> makeUpdate(const std::vector<std::string> &words, size_t count, size_t step)
+{
+	std::string text;
+	size_t units = 0;
+	nlohmann::json entities = nlohmann::json::array();
+	for (size_t i = 0; i < count; i++)
+	{
+		const std::string &word = words[i * 7919 % words.size()];
+		size_t length = 0;
+		for (unsigned char c:word)
+		{
+			if ((c & 0xC0) != 0x80) length += c >= 0xF0 ? 2 : 1;
+		}
+		if (i % step == 0) entities.push_back({{"type", "hashtag"}, {"offset", units}, {"length", length}});
+		text += word;
+		units += length;
+	}
+	nlohmann::json update = {{"update_id", 1}, {"message", {{"message_id", 1}, {"chat", {{"id", 1}}}, {"text", text}, {"entities", entities}}}};
+	return std::make_shared<nlohmann::json>(update);
+}
+
+static void extract(const char *name, const std::shared_ptr<nlohmann::json> &file, unsigned int iterations)
+{
+	Update update(file, file.get());
+	sink += update.entity_views().size();
+
+	unsigned long long before = allocations;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (unsigned int i = 0; i < iterations; i++)
+	{
+		EntityList entities = update.entity_views();
+		for (const EntityView &entity:entities) sink += entity.text.size;
+	}
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	unsigned long long allocated = allocations - before;
+
+	std::cout << name << ": " << (seconds * 1e9 / iterations) << " ns/message, " << ((double)allocated / iterations) << " allocations/message" << std::endl;
+}
+
+int main()
+{
+	std::vector<std::string> english = {"weather ", "in ", "London ", "is ", "light ", "rain ", "and ", "wind\n", "#forecast ", "/start "};
+	std::vector<std::string> russian = {"погода ", "в ", "Москве ", "лёгкий ", "дождь ", "и ", "ветер\n", "#прогноз "};
+	std::vector<std::string> chinese = {"天气", "伦敦", "小雨", "有风", "温度", "预报", "。\n"};
+	std::vector<std::string> emoji = {"🌧 ", "☀️ ", "👍🏽 ", "ℹ️ ", "🌡 ", "😀 "};
+	std::vector<std::string> mixed = {"Weather ", "погода ", "天气 ", "🌧 ", "+12.5° ", "C ", "Help ℹ️ ", "#tag\n"};
+
+	struct Language
+	{
+		const char *name;
+		const std::vector<std::string> *words;
+	};
+	Language languages[] = {{"english", &english}, {"russian", &russian}, {"chinese", &chinese}, {"emoji  ", &emoji}, {"mixed  ", &mixed}};
+
+	/* Converting offsets of a 1 MB text: the end only (a scan of the whole text) and one every 64 code units */
+	for (const Language &language:languages)
+	{
+		size_t units;
+		std::string text = makeText(*language.words, 1 << 20, units);
+		convert((std::string(language.name) + ", end,      simd ").c_str(), text, units, units, utf16ToUtf8);
+		convert((std::string(language.name) + ", end,      naive").c_str(), text, units, units, naive);
+		convert((std::string(language.name) + ", every 64, simd ").c_str(), text, units, 64, utf16ToUtf8);
+		convert((std::string(language.name) + ", every 64, naive").c_str(), text, units, 64, naive);
+	}
+
+	/* Entities of a long message (about 4096 code units) */
+	extract("english, 100 entities", makeUpdate(english, 600, 6), 100000);
+	extract("mixed,   100 entities", makeUpdate(mixed, 600, 6), 100000);
+	extract("mixed,   600 entities", makeUpdate(mixed, 600, 1), 20000);
+
+	return 0;
+}
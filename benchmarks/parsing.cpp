@@ -0,0 +1,217 @@
+#include "telegrab.hpp"
+
+#include <sstream>
+#include <cmath>
+#include "alloc_counter.hpp"
+
+void Telegrab::Instructions(Update)
+{
+}
+
+struct Result
+{
+	std::string name;
+	double ns;
+	double allocs;
+	double bytes;
+};
+
+static std::vector<Result> results;
+static volatile size_t sink;
+
+/* Runs the operation until it has taken at least 'seconds', after a short warm-up */
+static void run(const std::string &name, const std::function<size_t()> &operation, double seconds = 0.5)
+{
+	for (int i = 0; i < 16; i++) sink += operation();
+
+	unsigned long long iterations = 0, before = allocations, before_bytes = allocated_bytes;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	double elapsed = 0;
+	do
+	{
+		for (int i = 0; i < 64; i++) sink += operation();
+		iterations += 64;
+		elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+	while (elapsed < seconds);
+
+	Result result = {name, elapsed * 1e9 / iterations, (double)(allocations - before) / iterations, (double)(allocated_bytes - before_bytes) / iterations};
+	results.push_back(result);
+	printf("%-36s %12.0f ns/op %10.1f allocs/op %12.0f bytes/op\n", name.c_str(), result.ns, result.allocs, result.bytes);
+}
+
+static std::string readFile(const std::string &path)
+{
+	std::ifstream file(path, std::ios_base::in | std::ios_base::binary);
+	if (!file.is_open())
+	{
+		std::cerr << "\t| Error! Can't open " << path << "." << std::endl;
+		exit(2);
+	}
+	std::stringstream content;
+	content << file.rdbuf();
+	return content.str();
+}
+
+/* getUpdates response with the first 'count' updates of a recording made with "record" */
+static std::string readLog(const std::string &path, size_t count)
+{
+	UpdateLog log;
+	if (!log.open(path))
+	{
+		std::cerr << "\t| Error! Can't open " << path << "." << std::endl;
+		exit(2);
+	}
+	std::string payload = "{\"ok\":true,\"result\":[", update;
+	unsigned long long delay;
+	for (size_t i = 0; i < count && log.read(delay, update); i++)
+	{
+		if (i > 0) payload += ',';
+		payload += update;
+	}
+	return payload + "]}";
+}
+
+/* What waitForUpdates does with a response: parse it and look at every update */
+static size_t parseUpdates(const std::string &payload)
+{
+	std::shared_ptr<nlohmann::json> file = std::make_shared<nlohmann::json>(nlohmann::json::parse(payload, nullptr, false));
+	size_t seen = 0;
+	for (const auto& element:(*file)["result"])
+	{
+		Update update(file, &element);
+		seen += update.update_id() + update.type().size() + update.chat_id() + update.from().first_name().size();
+	}
+	return seen;
+}
+
+static size_t extractEntities(const std::shared_ptr<nlohmann::json> &file)
+{
+	size_t seen = 0;
+	for (const auto& element:(*file)["result"])
+	{
+		Update update(file, &element);
+		seen += update.entities().size();
+	}
+	return seen;
+}
+
+static bool check(const std::string &path, double tolerance)
+{
+	nlohmann::json baseline = nlohmann::json::parse(readFile(path), nullptr, false);
+	if (!baseline.is_object())
+	{
+		std::cerr << "\t| Error! Can't parse " << path << "." << std::endl;
+		return false;
+	}
+	bool ok = true;
+	for (const Result &result:results)
+	{
+		if (!baseline.count(result.name)) continue;
+		const nlohmann::json &base = baseline[result.name];
+		/* Time depends on the machine, allocations don't */
+		if (result.ns > base.value("ns", 0.0) * (1 + tolerance))
+		{
+			printf("REGRESSION %s: %.0f ns/op, baseline %.0f\n", result.name.c_str(), result.ns, base.value("ns", 0.0));
+			ok = false;
+		}
+		if (result.allocs > base.value("allocs", 0.0) * 1.01 + 0.01)
+		{
+			printf("REGRESSION %s: %.1f allocs/op, baseline %.1f\n", result.name.c_str(), result.allocs, base.value("allocs", 0.0));
+			ok = false;
+		}
+		if (result.bytes > base.value("bytes", 0.0) * 1.01 + 1)
+		{
+			printf("REGRESSION %s: %.0f bytes/op, baseline %.0f\n", result.name.c_str(), result.bytes, base.value("bytes", 0.0));
+			ok = false;
+		}
+	}
+	return ok;
+}
+
+static void save(const std::string &path)
+{
+	nlohmann::json baseline = nlohmann::json::object();
+	for (const Result &result:results)
+	{
+		baseline[result.name] = {{"ns", std::round(result.ns)}, {"allocs", std::round(result.allocs * 100) / 100}, {"bytes", std::round(result.bytes)}};
+	}
+	std::ofstream file(path, std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+	file << baseline.dump(1, '\t') << std::endl;
+}
+
+/* parsing [--payloads dir] [--log updates.rec] [--check baseline.json] [--save baseline.json] [--tolerance 0.3]
+Exits with 1 if a result is worse than the baseline. Times are only comparable with a baseline saved on the same host */
+int main(int argc, char **argv)
+{
+	std::string payloads = "benchmarks/payloads", log, baseline_check, baseline_save;
+	double tolerance = 0.3;
+	for (int i = 1; i + 1 < argc; i += 2)
+	{
+		std::string option = argv[i];
+		if (option == "--payloads") payloads = argv[i + 1];
+		else if (option == "--log") log = argv[i + 1];
+		else if (option == "--check") baseline_check = argv[i + 1];
+		else if (option == "--save") baseline_save = argv[i + 1];
+		else if (option == "--tolerance") tolerance = atof(argv[i + 1]);
+	}
+
+	std::vector<std::pair<std::string, std::string>> inputs;
+	if (!log.empty())
+	{
+		inputs.emplace_back("1 update", readLog(log, 1));
+		inputs.emplace_back("100 updates", readLog(log, 100));
+	}
+	else
+	{
+		inputs.emplace_back("1 update", readFile(payloads + "/updates_1.json"));
+		inputs.emplace_back("100 updates", readFile(payloads + "/updates_100.json"));
+		inputs.emplace_back("100 updates, entities", readFile(payloads + "/updates_100_entities.json"));
+	}
+
+	for (const auto& input:inputs)
+	{
+		const std::string &payload = input.second;
+		run("parse, " + input.first, [&payload]() { return parseUpdates(payload); });
+	}
+	for (const auto& input:inputs)
+	{
+		std::shared_ptr<nlohmann::json> file = std::make_shared<nlohmann::json>(nlohmann::json::parse(input.second));
+		run("entities, " + input.first, [file]() { return extractEntities(file); });
+	}
+
+	ReplyKeyboardMarkup keyboard = {};
+	for (int r = 0; r < 3; r++)
+	{
+		ReplyKeyboardRow row;
+		for (int c = 0; c < 3; c++)
+		{
+			KeyboardButton button = {};
+			button.text = "City " + std::to_string(r * 3 + c) + " 🌧";
+			button.request_location = r == 2 && c == 2;
+			row.push_back(button);
+		}
+		keyboard.keyboard.push_back(row);
+	}
+	keyboard.resize_keyboard = true;
+	ReplyKeyboardHide hide = {};
+	run("keyboard markup, 3x3", [&]() { return replyMarkup(keyboard, hide).size(); });
+
+	std::string text = "Weather in London, GB: light rain & wind.\n🌡 Temperature: +12.5° C. Tap \"Help ℹ️\" for more info (100% free).";
+	run("sendMessage body, form", [&]()
+	{
+		RequestBody &body = RequestBody::local(RequestBody::Form);
+		body.add("chat_id", 123456789LL).add("text", text).add("reply_to_message_id", 42LL).addJson("reply_markup", replyMarkup(keyboard, hide));
+		return body.size();
+	});
+	run("sendMessage body, json", [&]()
+	{
+		RequestBody &body = RequestBody::local(RequestBody::Json);
+		body.add("chat_id", 123456789LL).add("text", text).add("reply_to_message_id", 42LL).addJson("reply_markup", replyMarkup(keyboard, hide));
+		return body.size();
+	});
+
+	if (!baseline_save.empty()) save(baseline_save);
+	if (!baseline_check.empty() && !check(baseline_check, tolerance)) return 1;
+	return 0;
+}
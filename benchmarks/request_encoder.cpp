@@ -0,0 +1,55 @@
+#include "telegrab.hpp"
+
+#include "alloc_counter.hpp"
+
+void Telegrab::Instructions(Update)
+{
+}
+
+static void run(const char *name, RequestBody::Format format, const content &message, unsigned int iterations)
+{
+	/* Warm-up, so the thread-local buffers grow to the request size */
+	for (unsigned int i = 0; i < 16; i++)
+	{
+		RequestBody &body = RequestBody::local(format);
+		body.add("chat_id", 123456789LL).add("text", message.text).addJson("reply_markup", replyMarkup(message.reply_keyboard, message.hide_reply_keyboard));
+		body.size();
+	}
+
+	unsigned long long bytes = 0, before = allocations;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (unsigned int i = 0; i < iterations; i++)
+	{
+		RequestBody &body = RequestBody::local(format);
+		body.add("chat_id", 123456789LL + i).add("text", message.text).add("reply_to_message_id", (long long)i);
+		body.addJson("reply_markup", replyMarkup(message.reply_keyboard, message.hide_reply_keyboard));
+		bytes += body.size();
+	}
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	unsigned long long allocated = allocations - before;
+
+	std::cout << name << ": " << (bytes / seconds / 1048576) << " MB/s, " << (seconds * 1e9 / iterations) << " ns/request, ";
+	std::cout << ((double)allocated / iterations) << " allocations/request" << std::endl;
+}
+
+int main()
+{
+	content message = {};
+	message.text = "Weather in London, GB: light rain & wind.\n🌡 Temperature: +12.5° C. Tap \"Help ℹ️\" for more info (100% free).";
+	KeyboardButton button = {};
+	button.text = "Help ℹ️";
+	ReplyKeyboardRow row;
+	row.push_back(button);
+	message.reply_keyboard.keyboard.push_back(row);
+	message.reply_keyboard.resize_keyboard = true;
+
+	content large = message;
+	while (large.text.size() < 4000) large.text += message.text;
+
+	run("form, short text", RequestBody::Form, message, 1000000);
+	run("json, short text", RequestBody::Json, message, 1000000);
+	run("form, 4 KB text ", RequestBody::Form, large, 100000);
+	run("json, 4 KB text ", RequestBody::Json, large, 100000);
+
+	return 0;
+}
@@ -2,10 +2,10 @@
 
 #define OPEN_WEATHER_MAP_API_KEY "XXX"
 
-void Telegrab::Instructions(incoming data)
+void Telegrab::Instructions(Update data)
 {
 	// First, let's check if the message contains any special commands
-	for (const auto& entity:data.entities)
+	for (const auto& entity:data.entities())
 	{
 		// On '/start' command
 		if (entity == "/start")
@@ -39,18 +39,21 @@ void Telegrab::Instructions(incoming data)
 			message.reply_keyboard.selective = false;
 
 			// Sending our message to the same chat
-			send(message, data.chat_id);
+			send(message, data.chat_id());
 
 			return;
 		}
 	}
 
+	// Fields of the update are decoded only when you access them, so let's keep a copy of the text
+	std::string text = data.text();
+
 	// If incoming message contains text
-	if (!data.text.empty())
+	if (!text.empty())
 	{
 		// On button press
-		std::transform(data.text.begin(), data.text.end(), data.text.begin(), [](unsigned char c){ return std::tolower(c); });
-		if (data.text.find("help ℹ️") != std::string::npos)
+		std::transform(text.begin(), text.end(), text.begin(), [](unsigned char c){ return std::tolower(c); });
+		if (text.find("help ℹ️") != std::string::npos)
 		{
 			content message;
 			message.text = "To get information about the weather simply type the name of your sity (e.g. 'London' or 'london').";
@@ -62,44 +65,28 @@ void Telegrab::Instructions(incoming data)
 			h.selective = false;
 			message.hide_reply_keyboard = h;
 
-			send(message, data.chat_id);
+			send(message, data.chat_id());
 
 			return;
 		}
 
 		// Receiving info about the weather
-
-		CURL *curl = CurlInit();
-		if (!curl)
-		{
-			content message;
-			message.text = "Sorry, but we couldn't get information about the weather in that area.";
-			send(message, data.chat_id);
-
-			return;
-		}
-
-		std::string buffer, key = OPEN_WEATHER_MAP_API_KEY;
-		std::string url = "http://api.openweathermap.org/data/2.5/weather?units=metric&q=" + data.text + "&appid=" + key;
-
-		curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-		curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_0);
-		curl_easy_setopt(curl, CURLOPT_HTTPGET, 1L);
-		curl_easy_setopt(curl, CURLOPT_WRITEDATA, &buffer);
-		CURLcode res = curl_easy_perform(curl);
-		unsigned int http_code = 0;
-		curl_easy_getinfo (curl, CURLINFO_RESPONSE_CODE, &http_code);
-		curl_easy_cleanup(curl);
-		if (res != CURLE_OK)
+		// http() reuses connections and caches responses for a minute, so many users asking about the same city cost one request
+		std::string key = OPEN_WEATHER_MAP_API_KEY;
+		// The city goes into the URL percent-encoded, so names with spaces, '&' or non-Latin letters make a valid query
+		RequestBody &query = RequestBody::local();
+		query.add("q", text).add("appid", key);
+		HttpResponse response = http().get(std::string("http://api.openweathermap.org/data/2.5/weather?units=metric&") + query.data());
+		if (response.code != CURLE_OK)
 		{
 			content message;
 			message.text = "Sorry, but we couldn't get information about the weather in that area.";
-			send(message, data.chat_id);
+			send(message, data.chat_id());
 
 			return;
 		}
 
-		if (http_code == 404)
+		if (response.status == 404)
 		{
 			content message;
 			message.text = "Error: city not found.";
@@ -110,28 +97,28 @@ void Telegrab::Instructions(incoming data)
 			message.reply_keyboard.keyboard.push_back(row_1);
 			message.reply_keyboard.resize_keyboard = true;
 
-			send(message, data.chat_id);
+			send(message, data.chat_id());
 
 			return;
 		}
-		if (http_code == 429)
+		if (response.status == 429)
 		{
 			content message;
 			message.text = "Error: sorry, too many requests, please try again in a few minutes.";
 			
-			send(message, data.chat_id);
+			send(message, data.chat_id());
 
 			return;
 		}
-		if (http_code != 200)
+		if (response.status != 200)
 		{
 			content message;
 			message.text = "Sorry, but we couldn't get information about the weather in that area.";
-			send(message, data.chat_id);
+			send(message, data.chat_id());
 
 			return;
 		}
-		nlohmann::json json = nlohmann::json::parse(buffer);
+		nlohmann::json json = nlohmann::json::parse(response.body);
 
 		content message;
 		std::string foo = json["name"];
@@ -173,7 +160,7 @@ void Telegrab::Instructions(incoming data)
 		message.reply_keyboard.keyboard.push_back(row_1);
 		message.reply_keyboard.resize_keyboard = true;
 
-		send(message, data.chat_id);
+		send(message, data.chat_id());
 	}
 }
 
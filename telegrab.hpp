@@ -34,9 +34,39 @@ SOFTWARE.
 #include <fstream>
 #include <thread>
 #include <mutex>
+#include <memory>
+#include <array>
+#include <deque>
+#include <functional>
+#include <exception>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <map>
+#include <set>
+#include <list>
+#include <unordered_map>
+#include <cstdio>
+#include <cstring>
+#include <random>
 #include <curl/curl.h>
 #include <sys/stat.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <poll.h>
+#include <cerrno>
+#include <ctime>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "json.hpp"
 
 struct KeyboardButton
@@ -62,56 +92,3236 @@ struct ReplyKeyboardHide
 	bool selective;
 };
 
-struct incoming
+/* Byte positions in UTF-8 text of positions given in UTF-16 code units, which is how Telegram counts entity offsets.
+'positions' must be sorted, they are converted in place in one pass over the text. A position inside a character
+moves to the next character, positions past the end become the size of the text */
+static void utf16ToUtf8(const char *text, size_t size, size_t *positions, size_t count)
+{
+	size_t p = 0, i = 0, units = 0;
+#ifdef __SSE2__
+	/* 16 bytes at a time: continuation bytes (10xxxxxx) don't count, leading bytes of 4-byte characters (11110xxx)
+	count twice, as they are surrogate pairs in UTF-16 */
+	for (; p < count && i + 16 <= size; i += 16)
+	{
+		__m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text + i));
+		int high = _mm_movemask_epi8(chunk);
+		int starts = 0xFFFF, wide = 0;
+		if (high != 0)
+		{
+			starts = ~_mm_movemask_epi8(_mm_cmplt_epi8(chunk, _mm_set1_epi8(-64))) & 0xFFFF;
+			wide = _mm_movemask_epi8(_mm_cmpgt_epi8(chunk, _mm_set1_epi8(-17))) & high;
+		}
+		size_t chunk_units = __builtin_popcount(starts) + __builtin_popcount(wide);
+		/* Positions inside the chunk are found walking its characters once, from the mask of their starts */
+		int rest = starts;
+		size_t counted = units;
+		for (; p < count && positions[p] < units + chunk_units; p++)
+		{
+			while (rest != 0 && counted < positions[p])
+			{
+				counted += 1 + ((wide >> __builtin_ctz(rest)) & 1);
+				rest &= rest - 1;
+			}
+			if (rest != 0) positions[p] = i + __builtin_ctz(rest);
+			else
+			{
+				/* Second half of a surrogate pair that ends the chunk */
+				size_t j = i + 16;
+				while (j < size && (text[j] & 0xC0) == 0x80) j++;
+				positions[p] = j;
+			}
+		}
+		units += chunk_units;
+	}
+#endif
+	for (; p < count; p++)
+	{
+		size_t target = positions[p];
+#ifndef __SSE2__
+		/* 8 bytes at a time while they are ASCII */
+		while (i + 8 <= size && units + 8 <= target)
+		{
+			unsigned long long word;
+			memcpy(&word, text + i, 8);
+			if (word & 0x8080808080808080ull) break;
+			units += 8;
+			i += 8;
+		}
+#endif
+		for (; i < size; i++)
+		{
+			unsigned char c = text[i];
+			if ((c & 0xC0) == 0x80) continue;
+			if (units >= target) break;
+			units += c >= 0xF0 ? 2 : 1;
+		}
+		positions[p] = i;
+	}
+}
+
+/* Comparing with a literal of a known length is inlined, unlike std::string == const char* */
+template <size_t N> static bool keyIs(const std::string &key, const char (&name)[N])
+{
+	return key.size() == N - 1 && memcmp(key.data(), name, N - 1) == 0;
+}
+
+/* Part of a string of a parsed update, without a copy */
+struct TextSlice
+{
+	const char *data;
+	size_t size;
+	std::string str() const { return std::string(data, size); }
+	bool operator==(const std::string &other) const { return other.size() == size && memcmp(other.data(), data, size) == 0; }
+	bool operator!=(const std::string &other) const { return !(*this == other); }
+};
+
+/* Entity of a message, i.e. a command or a hashtag */
+struct EntityView
+{
+	TextSlice type;	// "bot_command", "hashtag", "mention", etc.
+	TextSlice text;	// part of the text it covers
+	size_t offset;	// where it starts in the text, in bytes
+};
+
+/* Entities of a message. The slices point into the update, which the list keeps alive */
+class EntityList
+{
+public:
+	EntityList() {}
+	EntityList(std::shared_ptr<const nlohmann::json> root, std::vector<EntityView> items):root(std::move(root)), items(std::move(items)) {}
+	size_t size() const { return items.size(); }
+	bool empty() const { return items.empty(); }
+	const EntityView &operator[](size_t i) const { return items[i]; }
+	std::vector<EntityView>::const_iterator begin() const { return items.begin(); }
+	std::vector<EntityView>::const_iterator end() const { return items.end(); }
+private:
+	std::shared_ptr<const nlohmann::json> root;
+	std::vector<EntityView> items;
+};
+
+/* Read-only view over a part of the parsed getUpdates response.
+The view keeps the whole batch alive and decodes fields only when they are accessed */
+class JsonView
+{
+public:
+	JsonView():node(nullptr) {}
+	JsonView(std::shared_ptr<const nlohmann::json> root, const nlohmann::json *node):root(std::move(root)), node(node) {}
+
+	bool empty() const { return node == nullptr || !node->is_object(); }
+	bool has(const std::string &key) const { return !empty() && node->find(key) != node->end(); }
+	/* Raw access for the fields without a dedicated accessor */
+	const nlohmann::json &json() const
+	{
+		static const nlohmann::json null_json;
+		return node ? *node : null_json;
+	}
+protected:
+	const nlohmann::json *child(const char *key) const
+	{
+		if (empty()) return nullptr;
+		auto it = node->find(key);
+		return it != node->end() ? &*it : nullptr;
+	}
+	std::string getString(const char *key) const
+	{
+		const nlohmann::json *value = child(key);
+		return value && value->is_string() ? value->get<std::string>() : "";
+	}
+	long long getInteger(const char *key) const
+	{
+		const nlohmann::json *value = child(key);
+		return value && value->is_number() ? value->get<long long>() : 0;
+	}
+	bool getBool(const char *key) const
+	{
+		const nlohmann::json *value = child(key);
+		return value && value->is_boolean() && value->get<bool>();
+	}
+	std::string getFileId(const char *key) const
+	{
+		const nlohmann::json *value = child(key);
+		if (!value || !value->is_object()) return "";
+		auto it = value->find("file_id");
+		return it != value->end() && it->is_string() ? it->get<std::string>() : "";
+	}
+	template <typename T> T view(const char *key) const { return T(root, child(key)); }
+
+	std::shared_ptr<const nlohmann::json> root;
+	const nlohmann::json *node;
+};
+
+class User : public JsonView
+{
+public:
+	using JsonView::JsonView;
+	long long id() const { return getInteger("id"); }
+	bool is_bot() const { return getBool("is_bot"); }
+	std::string first_name() const { return getString("first_name"); }
+	std::string last_name() const { return getString("last_name"); }
+	std::string username() const { return getString("username"); }
+	std::string language_code() const { return getString("language_code"); }
+};
+
+class Chat : public JsonView
+{
+public:
+	using JsonView::JsonView;
+	long long id() const { return getInteger("id"); }
+	std::string type() const { return getString("type"); }
+	std::string title() const { return getString("title"); }
+	std::string username() const { return getString("username"); }
+	std::string first_name() const { return getString("first_name"); }
+	std::string last_name() const { return getString("last_name"); }
+};
+
+class Message : public JsonView
+{
+public:
+	using JsonView::JsonView;
+	unsigned int message_id() const { return getInteger("message_id"); }
+	long long date() const { return getInteger("date"); }
+	Chat chat() const { return view<Chat>("chat"); }
+	long long chat_id() const { return chat().id(); }
+	User from() const { return view<User>("from"); }
+	Message reply_to_message() const { return view<Message>("reply_to_message"); }
+	std::string media_group_id() const { return getString("media_group_id"); }
+	std::string text() const { return getString("text"); }
+	std::string caption() const { return getString("caption"); }
+	std::string photo() const
+	{
+		/* Sizes are sorted in ascending order, pick the largest one that can still be downloaded */
+		std::string result;
+		const nlohmann::json *sizes = child("photo");
+		if (sizes && sizes->is_array())
+		{
+			for (const auto& image:*sizes)
+			{
+				if (image.count("file_size") != 0)
+				{
+					if (image["file_size"] > 20900000) break;
+				}
+				result = image.value("file_id", "");
+			}
+		}
+		return result;
+	}
+	std::string video() const { return getFileId("video"); }
+	std::string document() const { return getFileId("document"); }
+	std::string audio() const { return getFileId("audio"); }
+	std::string sticker() const { return getFileId("sticker"); }
+	std::string voice() const { return getFileId("voice"); }
+	/* All entities from the text (or from the caption), i.e. commands, hashtags, etc. */
+	std::vector<std::string> entities() const
+	{
+		EntityList views = entity_views();
+		std::vector<std::string> result;
+		result.reserve(views.size());
+		for (const EntityView &entity:views)
+		{
+			result.push_back(entity.text.str());
+		}
+		return result;
+	}
+	/* Same without copies: types and parts of the text as slices of the update */
+	EntityList entity_views() const
+	{
+		const nlohmann::json *source = child("text");
+		const nlohmann::json *list = child("entities");
+		if (!list)
+		{
+			source = child("caption");
+			list = child("caption_entities");
+		}
+		std::vector<EntityView> items;
+		if (!list || !list->is_array() || !source || !source->is_string()) return EntityList(root, std::move(items));
+		const std::string &text = source->get_ref<const std::string&>();
+
+		/* Starts and ends of all entities are converted in one pass. They are in order unless entities are nested */
+		static thread_local std::vector<std::pair<size_t, size_t>> points;
+		static thread_local std::vector<size_t> bytes;
+		static thread_local std::vector<TextSlice> types;
+		bytes.clear();
+		types.clear();
+		for (const auto& entity:*list)
+		{
+			/* One walk over the fields of the entity is cheaper than looking up each of them */
+			size_t offset = 0, length = 0;
+			TextSlice type = {"", 0};
+			if (entity.is_object())
+			{
+				for (const auto& field:entity.get_ref<const nlohmann::json::object_t&>())
+				{
+					const nlohmann::json &value = field.second;
+					if (keyIs(field.first, "offset") && value.is_number_unsigned()) offset = value.get_ref<const nlohmann::json::number_unsigned_t&>();
+					else if (keyIs(field.first, "length") && value.is_number_unsigned()) length = value.get_ref<const nlohmann::json::number_unsigned_t&>();
+					else if (keyIs(field.first, "type") && value.is_string()) type = TextSlice{value.get_ref<const std::string&>().data(), value.get_ref<const std::string&>().size()};
+				}
+			}
+			bytes.push_back(offset);
+			bytes.push_back(offset + length);
+			types.push_back(type);
+		}
+		if (std::is_sorted(bytes.begin(), bytes.end())) utf16ToUtf8(text.data(), text.size(), bytes.data(), bytes.size());
+		else
+		{
+			points.clear();
+			for (size_t i = 0; i < bytes.size(); i++) points.emplace_back(bytes[i], i);
+			std::sort(points.begin(), points.end());
+			for (size_t i = 0; i < points.size(); i++) bytes[i] = points[i].first;
+			utf16ToUtf8(text.data(), text.size(), bytes.data(), bytes.size());
+			for (size_t i = 0; i < points.size(); i++) points[i].first = bytes[i];
+			for (size_t i = 0; i < points.size(); i++) bytes[points[i].second] = points[i].first;
+		}
+
+		items.reserve(types.size());
+		for (size_t i = 0; i < types.size(); i++)
+		{
+			size_t begin = bytes[2 * i], end = std::max(begin, bytes[2 * i + 1]);
+			items.push_back(EntityView{types[i], TextSlice{text.data() + begin, end - begin}, begin});
+		}
+		return EntityList(root, std::move(items));
+	}
+};
+
+class CallbackQuery : public JsonView
+{
+public:
+	using JsonView::JsonView;
+	std::string id() const { return getString("id"); }
+	User from() const { return view<User>("from"); }
+	Message message() const { return view<Message>("message"); }
+	std::string inline_message_id() const { return getString("inline_message_id"); }
+	std::string chat_instance() const { return getString("chat_instance"); }
+	std::string data() const { return getString("data"); }
+	std::string game_short_name() const { return getString("game_short_name"); }
+};
+
+class InlineQuery : public JsonView
+{
+public:
+	using JsonView::JsonView;
+	std::string id() const { return getString("id"); }
+	User from() const { return view<User>("from"); }
+	std::string query() const { return getString("query"); }
+	std::string offset() const { return getString("offset"); }
+};
+
+/* A single incoming update. Message shortcuts (chat_id(), text(), etc.) refer to
+the message, edited_message, channel_post or edited_channel_post of the update,
+and to the message with the pressed button for callback queries */
+class Update : public JsonView
+{
+public:
+	using JsonView::JsonView;
+	unsigned int update_id() const { return getInteger("update_id"); }
+	/* Name of the update type, i.e. "message", "callback_query", etc. */
+	std::string type() const
+	{
+		if (!empty())
+		{
+			for (auto it = node->begin(); it != node->end(); ++it)
+			{
+				if (it.key() != "update_id") return it.key();
+			}
+		}
+		return "";
+	}
+	Message message() const
+	{
+		static const char *keys[] = {"message", "edited_message", "channel_post", "edited_channel_post"};
+		for (const char *key:keys)
+		{
+			if (child(key)) return view<Message>(key);
+		}
+		return callback_query().message();
+	}
+	Message edited_message() const { return view<Message>("edited_message"); }
+	Message channel_post() const { return view<Message>("channel_post"); }
+	Message edited_channel_post() const { return view<Message>("edited_channel_post"); }
+	CallbackQuery callback_query() const { return view<CallbackQuery>("callback_query"); }
+	InlineQuery inline_query() const { return view<InlineQuery>("inline_query"); }
+	/* Sender of the update, whatever its type is */
+	User from() const
+	{
+		std::string key = type();
+		const nlohmann::json *value = child(key.c_str());
+		if (!value || !value->is_object()) return User();
+		auto it = value->find("from");
+		return it != value->end() ? User(root, &*it) : User();
+	}
+
+	long long chat_id() const { return message().chat_id(); }
+	unsigned int message_id() const { return message().message_id(); }
+	std::string text() const { return message().text(); }
+	std::string caption() const { return message().caption(); }
+	std::string photo() const { return message().photo(); }
+	std::string video() const { return message().video(); }
+	std::string document() const { return message().document(); }
+	std::string audio() const { return message().audio(); }
+	std::string sticker() const { return message().sticker(); }
+	std::string voice() const { return message().voice(); }
+	std::vector<std::string> entities() const { return message().entities(); }
+	EntityList entity_views() const { return message().entity_views(); }
+};
+
+/* File of a media group: "photo", "video", "document" or "audio", and a local file, file_id or URL */
+struct Attachment
+{
+	std::string type;
+	std::string media;
+};
+
+struct content
 {
-	unsigned int chat_id;
-	unsigned int message_id;
 	std::string photo;
 	std::string video;
 	std::string document;
 	std::string text;
 	std::string audio;
 	std::string sticker;
-	std::string voice;
-	std::string caption;
-	std::vector<std::string> entities;
+	ReplyKeyboardMarkup reply_keyboard;
+	ReplyKeyboardHide hide_reply_keyboard;
+	std::vector<Attachment> attachments;	// sent as albums, see Telegrab::send
+};
+
+/* Type of an attachment as sendFile knows it (1 - photo, 2 - video, 3 - document, 4 - audio), 0 if it's unknown */
+static unsigned char attachmentType(const std::string &type)
+{
+	if (type == "photo") return 1;
+	if (type == "video") return 2;
+	if (type == "document") return 3;
+	if (type == "audio") return 4;
+	return 0;
+}
+
+/* JSON form of the outgoing messages, used to persist them */
+inline void to_json(nlohmann::json &json, const KeyboardButton &button)
+{
+	json = nlohmann::json{{"text", button.text}, {"request_contact", button.request_contact == true}, {"request_location", button.request_location == true}};
+}
+inline void from_json(const nlohmann::json &json, KeyboardButton &button)
+{
+	button.text = json.value("text", "");
+	button.request_contact = json.value("request_contact", false);
+	button.request_location = json.value("request_location", false);
+}
+inline void to_json(nlohmann::json &json, const content &message)
+{
+	json = nlohmann::json{{"photo", message.photo}, {"video", message.video}, {"document", message.document}, {"text", message.text}, {"audio", message.audio}, {"sticker", message.sticker}};
+	json["reply_keyboard"]["keyboard"] = message.reply_keyboard.keyboard;
+	json["reply_keyboard"]["resize_keyboard"] = message.reply_keyboard.resize_keyboard == true;
+	json["reply_keyboard"]["one_time_keyboard"] = message.reply_keyboard.one_time_keyboard == true;
+	json["reply_keyboard"]["selective"] = message.reply_keyboard.selective == true;
+	json["hide_reply_keyboard"]["hide"] = message.hide_reply_keyboard.hide == true;
+	json["hide_reply_keyboard"]["selective"] = message.hide_reply_keyboard.selective == true;
+	json["attachments"] = nlohmann::json::array();
+	for (const auto& attachment:message.attachments)
+	{
+		json["attachments"].push_back({{"type", attachment.type}, {"media", attachment.media}});
+	}
+}
+inline void from_json(const nlohmann::json &json, content &message)
+{
+	message.photo = json.value("photo", "");
+	message.video = json.value("video", "");
+	message.document = json.value("document", "");
+	message.text = json.value("text", "");
+	message.audio = json.value("audio", "");
+	message.sticker = json.value("sticker", "");
+	nlohmann::json keyboard = json.value("reply_keyboard", nlohmann::json::object());
+	message.reply_keyboard.keyboard = keyboard.value("keyboard", std::vector<ReplyKeyboardRow>());
+	message.reply_keyboard.resize_keyboard = keyboard.value("resize_keyboard", false);
+	message.reply_keyboard.one_time_keyboard = keyboard.value("one_time_keyboard", false);
+	message.reply_keyboard.selective = keyboard.value("selective", false);
+	nlohmann::json hide = json.value("hide_reply_keyboard", nlohmann::json::object());
+	message.hide_reply_keyboard.hide = hide.value("hide", false);
+	message.hide_reply_keyboard.selective = hide.value("selective", false);
+	message.attachments.clear();
+	for (const auto& attachment:json.value("attachments", nlohmann::json::array()))
+	{
+		message.attachments.push_back(Attachment{attachment.value("type", ""), attachment.value("media", "")});
+	}
+}
+
+static size_t curlWriter(char *data, size_t size, size_t nmemb, std::string *buffer)
+{
+	size_t result = size * nmemb;
+	buffer->append(data, result);
+	return result;
+}
+
+static size_t curlFileWriter(char *data, size_t size, size_t nmemb, std::ofstream *file)
+{
+	size_t result = size * nmemb;
+	file->write(data, result);
+	return result;
+}
+
+static void curlDefaults(CURL *curl)
+{
+	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curlWriter);
+	curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0L);
+	curl_easy_setopt(curl, CURLOPT_POST, 1);
+}
+
+/* Characters that are sent as is in application/x-www-form-urlencoded bodies */
+static const unsigned char urlUnreserved[256] =
+{
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0,
+	0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 1,
+	0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 1, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+};
+
+/* Body of an API request, either application/x-www-form-urlencoded or application/json.
+Buffers are thread-local and reused, so once they've grown to the usual request size
+building a request doesn't allocate at all */
+class RequestBody
+{
+public:
+	enum Format
+	{
+		Form,
+		Json
+	};
+
+	/* Empty body of the calling thread. It stays valid until the next call from the same thread */
+	static RequestBody &local(Format format = Form)
+	{
+		static thread_local RequestBody body;
+		body.clear(format);
+		return body;
+	}
+
+	RequestBody &add(const char *key, const char *value, size_t size)
+	{
+		appendKey(key);
+		if (format == Json)
+		{
+			buffer += '"';
+			appendEscaped(buffer, value, size);
+			buffer += '"';
+		}
+		else appendEncoded(value, size);
+		return *this;
+	}
+	RequestBody &add(const char *key, const std::string &value) { return add(key, value.data(), value.size()); }
+	RequestBody &add(const char *key, long long value)
+	{
+		char number[24];
+		int size = snprintf(number, sizeof(number), "%lld", value);
+		appendKey(key);
+		buffer.append(number, size);
+		return *this;
+	}
+	RequestBody &add(const char *key, bool value)
+	{
+		appendKey(key);
+		buffer += value ? "true" : "false";
+		return *this;
+	}
+	/* Value that is already serialized JSON, i.e. reply_markup */
+	RequestBody &addJson(const char *key, const std::string &json)
+	{
+		appendKey(key);
+		if (format == Json) buffer += json;
+		else appendEncoded(json.data(), json.size());
+		return *this;
+	}
+
+	const char *data()
+	{
+		if (format == Json && !closed)
+		{
+			buffer += '}';
+			closed = true;
+		}
+		return buffer.c_str();
+	}
+	size_t size()
+	{
+		data();
+		return buffer.size();
+	}
+	Format type() const { return format; }
+
+	/* Escapes the string for a JSON string literal */
+	static void appendEscaped(std::string &out, const char *value, size_t size)
+	{
+		static const char hex[] = "0123456789abcdef";
+		size_t start = 0;
+		for (size_t i = 0; i < size; i++)
+		{
+			unsigned char c = value[i];
+			if (c >= 0x20 && c != '"' && c != '\\') continue;
+			out.append(value + start, i - start);
+			switch (c)
+			{
+				case '"': out += "\\\""; break;
+				case '\\': out += "\\\\"; break;
+				case '\n': out += "\\n"; break;
+				case '\r': out += "\\r"; break;
+				case '\t': out += "\\t"; break;
+				default:
+				{
+					char escaped[6] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 15]};
+					out.append(escaped, 6);
+				}
+			}
+			start = i + 1;
+		}
+		out.append(value + start, size - start);
+	}
+private:
+	RequestBody():format(Form), closed(false)
+	{
+		buffer.reserve(4096);
+	}
+	void clear(Format format)
+	{
+		this->format = format;
+		closed = false;
+		buffer.clear();
+		if (format == Json) buffer += '{';
+	}
+	void appendKey(const char *key)
+	{
+		if (format == Json)
+		{
+			if (buffer.size() > 1) buffer += ',';
+			buffer += '"';
+			buffer += key;
+			buffer += "\":";
+		}
+		else
+		{
+			if (!buffer.empty()) buffer += '&';
+			buffer += key;
+			buffer += '=';
+		}
+	}
+	void appendEncoded(const char *value, size_t size)
+	{
+		static const char hex[] = "0123456789ABCDEF";
+		/* Reserve the worst case and write in place, then cut the buffer to the real size */
+		size_t used = buffer.size();
+		buffer.resize(used + size * 3);
+		char *out = &buffer[used];
+		for (size_t i = 0; i < size; i++)
+		{
+			unsigned char c = value[i];
+			if (urlUnreserved[c])
+			{
+				*out++ = c;
+			}
+			else
+			{
+				out[0] = '%';
+				out[1] = hex[c >> 4];
+				out[2] = hex[c & 15];
+				out += 3;
+			}
+		}
+		buffer.resize(out - buffer.data());
+	}
+
+	std::string buffer;
+	Format format;
+	bool closed;
+};
+
+/* Serialized reply_markup of the message (empty if there is no keyboard), in a reused thread-local buffer */
+static const std::string &replyMarkup(const ReplyKeyboardMarkup &reply_keyboard, const ReplyKeyboardHide &hide_reply_keyboard)
+{
+	static thread_local std::string markup;
+	markup.clear();
+	if (!reply_keyboard.keyboard.empty())
+	{
+		markup += "{\"keyboard\":[";
+		for (size_t i = 0; i < reply_keyboard.keyboard.size(); i++)
+		{
+			if (i > 0) markup += ',';
+			markup += '[';
+			const ReplyKeyboardRow &row = reply_keyboard.keyboard[i];
+			for (size_t j = 0; j < row.size(); j++)
+			{
+				if (j > 0) markup += ',';
+				bool first = true;
+				markup += '{';
+				if (!row[j].text.empty())
+				{
+					markup += "\"text\":\"";
+					RequestBody::appendEscaped(markup, row[j].text.data(), row[j].text.size());
+					markup += '"';
+					first = false;
+				}
+				if (row[j].request_contact == true)
+				{
+					markup += first ? "\"request_contact\":true" : ",\"request_contact\":true";
+					first = false;
+				}
+				if (row[j].request_location == true)
+				{
+					markup += first ? "\"request_location\":true" : ",\"request_location\":true";
+				}
+				markup += '}';
+			}
+			markup += ']';
+		}
+		markup += ']';
+		if (reply_keyboard.resize_keyboard == true) markup += ",\"resize_keyboard\":true";
+		if (reply_keyboard.one_time_keyboard == true) markup += ",\"one_time_keyboard\":true";
+		if (reply_keyboard.selective == true) markup += ",\"selective\":true";
+		markup += '}';
+	}
+	else if (hide_reply_keyboard.hide == true)
+	{
+		markup += "{\"hide_keyboard\":true";
+		if (hide_reply_keyboard.selective == true) markup += ",\"selective\":true";
+		markup += '}';
+	}
+	return markup;
+}
+
+/* Where a text longer than 'limit' UTF-16 code units (that's how Telegram measures messages) should be split:
+after the last line break that fits, after the last space or in the middle of a word. npos if the text fits */
+static size_t splitText(const std::string &text, size_t start, size_t limit)
+{
+	size_t units = 0, line = 0, space = 0;
+	for (size_t i = start; i < text.size();)
+	{
+		unsigned char c = text[i];
+		size_t length = c < 0x80 ? 1 : c < 0xE0 ? 2 : c < 0xF0 ? 3 : 4;
+		units += length == 4 ? 2 : 1;
+		if (units > limit)
+		{
+			if (line > start) return line;
+			if (space > start) return space;
+			return i > start ? i : i + length;
+		}
+		if (c == '\n') line = i + 1;
+		else if (c == ' ') space = i + 1;
+		i += length;
+	}
+	return std::string::npos;
+}
+
+/* Priority classes of the outbound requests */
+enum class Priority
+{
+	Interactive,	// replies to users and callback answers
+	Normal,			// regular sends
+	Bulk			// broadcasts and other mass sending
+};
+
+/* Queue-to-completion latency of one priority class, in milliseconds */
+struct LatencyStats
+{
+	unsigned long long count;
+	unsigned long long over_slo;
+	double p50;
+	double p99;
+	double max;
+};
+
+/* Span tracing of single updates, from getUpdates to the requests made by the handler.
+The trace id is the update_id, and whether an update is traced only depends on the id, so every process of a cluster
+makes the same choice. Spans go to a ring buffer of the thread that recorded them (buffers of finished threads are
+reused by new ones), and exportJson() writes them in the Chrome trace event format, which Perfetto and chrome://tracing open */
+class Tracer
+{
+public:
+	static Tracer &instance()
+	{
+		static Tracer tracer;
+		return tracer;
+	}
+	/* Trace of the update handled by this thread, 0 if it isn't traced */
+	static unsigned long long &context()
+	{
+		static thread_local unsigned long long trace = 0;
+		return trace;
+	}
+
+	void configure(double sample_rate, size_t buffer_size)
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		threshold = sample_rate <= 0 ? 0 : sample_rate >= 1 ? ~0ULL : static_cast<unsigned long long>(sample_rate * 18446744073709551615.0);
+		this->buffer_size = std::max<size_t>(16, buffer_size);
+	}
+	bool sampled(unsigned long long trace) const
+	{
+		if (threshold == 0 || trace == 0) return false;
+		unsigned long long x = trace;
+		x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+		return (x ^ (x >> 31)) <= threshold;
+	}
+	void record(const char *name, unsigned long long trace, std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end)
+	{
+		Buffer &buffer = local();
+		std::lock_guard<std::mutex> lock(buffer.mtx);
+		Span &span = buffer.spans[buffer.next % buffer.spans.size()];
+		strncpy(span.name, name, sizeof(span.name) - 1);
+		span.name[sizeof(span.name) - 1] = 0;
+		span.trace = trace;
+		span.start = std::chrono::duration_cast<std::chrono::microseconds>(start.time_since_epoch()).count();
+		span.duration = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+		span.thread = buffer.thread;
+		buffer.next++;
+	}
+	bool exportJson(const std::string &path)
+	{
+		nlohmann::json events = nlohmann::json::array();
+		int pid = getpid();
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			for (auto& buffer:buffers)
+			{
+				std::lock_guard<std::mutex> buffer_lock(buffer->mtx);
+				size_t count = std::min<unsigned long long>(buffer->next, buffer->spans.size());
+				for (size_t i = 0; i < count; i++)
+				{
+					const Span &span = buffer->spans[(buffer->next - count + i) % buffer->spans.size()];
+					events.push_back({{"name", span.name}, {"cat", "telegrab"}, {"ph", "X"}, {"ts", span.start}, {"dur", span.duration},
+						{"pid", pid}, {"tid", span.thread}, {"args", {{"update_id", span.trace}}}});
+				}
+			}
+		}
+		std::ofstream file(path, std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+		if (!file.is_open()) return false;
+		file << nlohmann::json{{"traceEvents", events}, {"displayTimeUnit", "ms"}};
+		return file.good();
+	}
+private:
+	struct Span
+	{
+		char name[24];
+		unsigned long long trace;
+		long long start;	// microseconds
+		unsigned int duration;
+		unsigned int thread;
+	};
+	struct Buffer
+	{
+		std::vector<Span> spans;
+		unsigned long long next = 0;
+		unsigned int thread = 0;
+		std::mutex mtx;
+	};
+	/* Gives the buffer back when its thread ends */
+	struct Holder
+	{
+		Buffer *buffer = nullptr;
+		~Holder()
+		{
+			if (buffer) Tracer::instance().release(buffer);
+		}
+	};
+
+	Tracer():threshold(0), buffer_size(4096), threads(0) {}
+	Buffer &local()
+	{
+		static thread_local Holder holder;
+		if (!holder.buffer)
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			if (free.empty())
+			{
+				buffers.emplace_back(new Buffer());
+				buffers.back()->spans.resize(buffer_size);
+				free.push_back(buffers.back().get());
+			}
+			holder.buffer = free.back();
+			free.pop_back();
+			holder.buffer->thread = ++threads;
+		}
+		return *holder.buffer;
+	}
+	void release(Buffer *buffer)
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		free.push_back(buffer);
+	}
+
+	std::atomic<unsigned long long> threshold;
+	size_t buffer_size;
+	unsigned int threads;
+	std::vector<std::unique_ptr<Buffer>> buffers;
+	std::vector<Buffer*> free;
+	std::mutex mtx;
+};
+
+/* Makes the update the trace context of the current thread, if it is sampled */
+class TraceScope
+{
+public:
+	explicit TraceScope(unsigned long long trace):previous(Tracer::context())
+	{
+		Tracer::context() = Tracer::instance().sampled(trace) ? trace : 0;
+	}
+	~TraceScope() { Tracer::context() = previous; }
+private:
+	unsigned long long previous;
+};
+
+/* Records a span of the current trace context from construction to destruction */
+class TraceSpan
+{
+public:
+	explicit TraceSpan(const char *name):name(name), trace(Tracer::context())
+	{
+		if (trace) start = std::chrono::steady_clock::now();
+	}
+	~TraceSpan()
+	{
+		if (trace) Tracer::instance().record(name, trace, start, std::chrono::steady_clock::now());
+	}
+private:
+	const char *name;
+	unsigned long long trace;
+	std::chrono::steady_clock::time_point start;
+};
+
+/* What Outbound does before the first request */
+struct Warmup
+{
+	std::string url;	// HEAD requests to this address open the connections
+	unsigned int connections;	// how many connections are opened, 0 - none
+	std::string tls_cache;	// file the TLS sessions are loaded from and saved to, empty - none
+};
+
+/* Startup of the bot (milliseconds) */
+struct StartupStats
+{
+	double constructed;	// time spent in the constructor
+	double first_reply;	// from the constructor to the first successful Bot API request, 0 - none yet
+	unsigned int warmed;	// connections opened before the first request
+	unsigned int tls_sessions;	// TLS sessions loaded from the cache file
+};
+
+/* Outbound request scheduler.
+Each priority class has its own queue and connection budget (the maximum number of its requests in flight),
+and normal and bulk requests together always leave one connection to interactive ones.
+Workers own a persistent cURL handle each, so connections are reused between requests,
+and always take the next job from the highest priority queue that is still within its budget */
+class Outbound
+{
+public:
+	Outbound(unsigned int connections, std::array<unsigned int, 3> budgets, std::array<unsigned int, 3> slo, const Warmup &warmup = Warmup());
+	~Outbound();
+	/* Runs the job on a pooled connection and blocks until it's done. Returns false if cURL is not working properly */
+	bool perform(Priority priority, const std::function<void(CURL*)> &job);
+	/* Lets a handle made elsewhere use the shared connections, DNS and TLS session caches */
+	void attach(CURL *curl);
+	LatencyStats latency(Priority priority);
+	StartupStats startup(std::chrono::steady_clock::time_point since);
+private:
+	struct Job
+	{
+		const std::function<void(CURL*)> *run;
+		std::chrono::steady_clock::time_point queued;
+		unsigned long long trace;
+		bool done;
+		bool ok;
+	};
+	struct Samples
+	{
+		std::vector<double> ring;
+		size_t next;
+		unsigned long long count;
+		unsigned long long over_slo;
+	};
+
+	void worker(unsigned int index);
+	int pick() const;
+	static const char *method(CURL *curl);
+	void warm(CURL *curl);
+	unsigned int loadSessions();
+	void saveSessions();
+	static void lock(CURL*, curl_lock_data data, curl_lock_access, void *outbound);
+	static void unlock(CURL*, curl_lock_data data, void *outbound);
+
+	Warmup warmup;
+	CURLSH *share;
+	std::array<std::mutex, CURL_LOCK_DATA_LAST> locks;
+	std::atomic<unsigned int> warmed;
+	unsigned int tls_sessions;
+	bool replied;
+	std::chrono::steady_clock::time_point first_reply;
+	unsigned int connections;
+	std::array<unsigned int, 3> budgets;
+	std::array<unsigned int, 3> slo;
+	std::array<unsigned int, 3> in_flight;
+	std::array<std::deque<Job*>, 3> queues;
+	std::array<Samples, 3> samples;
+	std::vector<std::thread> workers;
+	std::mutex mtx;
+	std::condition_variable work;
+	std::condition_variable finished;
+	bool stopping;
+};
+
+Outbound::Outbound(unsigned int connections, std::array<unsigned int, 3> budgets, std::array<unsigned int, 3> slo, const Warmup &warmup):warmup(warmup), warmed(0), tls_sessions(0), replied(false), connections(connections), budgets(budgets), slo(slo), stopping(false)
+{
+	/* All workers share the connections and resolve names and resume TLS sessions through the same caches,
+	so any of them can use a connection opened by another */
+	share = curl_share_init();
+	if (share)
+	{
+		curl_share_setopt(share, CURLSHOPT_LOCKFUNC, lock);
+		curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, unlock);
+		curl_share_setopt(share, CURLSHOPT_USERDATA, this);
+		curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+		curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+		curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+		if (!warmup.tls_cache.empty()) tls_sessions = loadSessions();
+	}
+	if (connections == 0) connections = 1;
+	this->connections = connections;
+	for (unsigned int i = 0; i < 3; i++)
+	{
+		if (this->budgets[i] == 0 || this->budgets[i] > connections) this->budgets[i] = connections;
+		in_flight[i] = 0;
+		samples[i].ring.assign(1024, 0);
+		samples[i].next = 0;
+		samples[i].count = 0;
+		samples[i].over_slo = 0;
+	}
+	for (unsigned int i = 0; i < connections; i++)
+	{
+		workers.emplace_back(&Outbound::worker, this, i);
+	}
+}
+Outbound::~Outbound()
+{
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		stopping = true;
+	}
+	work.notify_all();
+	for (auto& thread:workers)
+	{
+		thread.join();
+	}
+	if (share)
+	{
+		if (!warmup.tls_cache.empty()) saveSessions();
+		curl_share_cleanup(share);
+	}
+}
+void Outbound::lock(CURL*, curl_lock_data data, curl_lock_access, void *outbound)
+{
+	static_cast<Outbound*>(outbound)->locks[data].lock();
+}
+void Outbound::unlock(CURL*, curl_lock_data data, void *outbound)
+{
+	static_cast<Outbound*>(outbound)->locks[data].unlock();
+}
+void Outbound::attach(CURL *curl)
+{
+	if (share) curl_easy_setopt(curl, CURLOPT_SHARE, share);
+}
+/* Opens a connection with a HEAD request, so the first real requests don't wait for DNS, TCP and TLS */
+void Outbound::warm(CURL *curl)
+{
+	curlDefaults(curl);
+	curl_easy_setopt(curl, CURLOPT_URL, warmup.url.c_str());
+	curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+	curl_easy_setopt(curl, CURLOPT_TIMEOUT, 10L);
+	if (curl_easy_perform(curl) == CURLE_OK) warmed++;
+}
+/* The TLS session cache file is a header followed by (key, hmac, session) records, every field is a 32-bit length and bytes.
+Exporting and importing sessions needs libcurl 8.12.0 or newer, older versions only share them between the workers */
+#if LIBCURL_VERSION_NUM >= 0x080c00
+static bool readField(FILE *file, std::string &field)
+{
+	unsigned char size[4];
+	if (fread(size, 1, 4, file) != 4) return false;
+	unsigned long length = (unsigned long)size[0] << 24 | size[1] << 16 | size[2] << 8 | size[3];
+	if (length > (1 << 20)) return false;
+	field.resize(length);
+	return length == 0 || fread(&field[0], 1, length, file) == length;
+}
+static void writeField(FILE *file, const void *data, size_t length)
+{
+	unsigned char size[4] = {(unsigned char)(length >> 24), (unsigned char)(length >> 16), (unsigned char)(length >> 8), (unsigned char)length};
+	fwrite(size, 1, 4, file);
+	if (length > 0) fwrite(data, 1, length, file);
+}
+static CURLcode exportSession(CURL*, void *file, const char *key, const unsigned char *hmac, size_t hmac_length, const unsigned char *session, size_t session_length,
+	curl_off_t, int, const char*, size_t)
+{
+	if (!file) return CURLE_OK;
+	writeField(static_cast<FILE*>(file), key, key ? strlen(key) : 0);
+	writeField(static_cast<FILE*>(file), hmac, hmac_length);
+	writeField(static_cast<FILE*>(file), session, session_length);
+	return CURLE_OK;
+}
+#endif
+unsigned int Outbound::loadSessions()
+{
+	unsigned int loaded = 0;
+#if LIBCURL_VERSION_NUM >= 0x080c00
+	CURL *curl = curl_easy_init();
+	if (!curl) return 0;
+	curl_easy_setopt(curl, CURLOPT_SHARE, share);
+	/* Export is a build option of libcurl (--enable-ssls-export), without it the sessions are only shared in memory */
+	if (curl_easy_ssls_export(curl, exportSession, nullptr) == CURLE_NOT_BUILT_IN)
+	{
+		std::cerr << "\t| Error! libcurl is built without TLS session export, " << warmup.tls_cache << " is not used." << std::endl;
+		warmup.tls_cache.clear();
+		curl_easy_cleanup(curl);
+		return 0;
+	}
+	FILE *file = fopen(warmup.tls_cache.c_str(), "rb");
+	char header[8];
+	if (file && fread(header, 1, 8, file) == 8 && memcmp(header, "TGTLS1\n", 8) == 0)
+	{
+		std::string key, hmac, session;
+		while (readField(file, key) && readField(file, hmac) && readField(file, session))
+		{
+			if (curl_easy_ssls_import(curl, key.empty() ? nullptr : key.c_str(), (const unsigned char*)hmac.data(), hmac.size(),
+				(const unsigned char*)session.data(), session.size()) == CURLE_OK) loaded++;
+		}
+	}
+	if (file) fclose(file);
+	curl_easy_cleanup(curl);
+#endif
+	return loaded;
+}
+void Outbound::saveSessions()
+{
+#if LIBCURL_VERSION_NUM >= 0x080c00
+	/* Written next to the old file and renamed, so a crash never leaves a torn cache. Sessions are secrets, only the owner can read them */
+	std::string temp = warmup.tls_cache + ".tmp";
+	int fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+	FILE *file = fd == -1 ? nullptr : fdopen(fd, "wb");
+	CURL *curl = curl_easy_init();
+	if (file && curl)
+	{
+		curl_easy_setopt(curl, CURLOPT_SHARE, share);
+		fwrite("TGTLS1\n", 1, 8, file);
+		bool ok = curl_easy_ssls_export(curl, exportSession, file) == CURLE_OK;
+		ok = fclose(file) == 0 && ok;
+		file = nullptr;
+		if (!ok || rename(temp.c_str(), warmup.tls_cache.c_str()) != 0)
+		{
+			std::cerr << "\t| Error! Can't save TLS sessions to " << warmup.tls_cache << "." << std::endl;
+			unlink(temp.c_str());
+		}
+	}
+	else if (fd != -1 && !file) close(fd);
+	if (file) fclose(file);
+	if (curl) curl_easy_cleanup(curl);
+#endif
+}
+StartupStats Outbound::startup(std::chrono::steady_clock::time_point since)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	return StartupStats{0, replied ? std::chrono::duration<double, std::milli>(first_reply - since).count() : 0, warmed.load(), tls_sessions};
+}
+int Outbound::pick() const
+{
+	/* Requests are never interrupted, so an interactive one would otherwise wait behind a full pool of lower ones */
+	bool reserved = connections > 1 && in_flight[1] + in_flight[2] + 1 >= connections;
+	for (int i = 0; i < 3; i++)
+	{
+		if (!queues[i].empty() && in_flight[i] < budgets[i] && (i == 0 || !reserved)) return i;
+	}
+	return -1;
+}
+bool Outbound::perform(Priority priority, const std::function<void(CURL*)> &job)
+{
+	Job item = {&job, std::chrono::steady_clock::now(), Tracer::context(), false, false};
+	std::unique_lock<std::mutex> lock(mtx);
+	queues[static_cast<int>(priority)].push_back(&item);
+	work.notify_one();
+	finished.wait(lock, [&item]{ return item.done; });
+	return item.ok;
+}
+void Outbound::worker(unsigned int index)
+{
+	CURL *curl = curl_easy_init();
+	if (curl) attach(curl);
+	if (curl && index < warmup.connections && !warmup.url.empty()) warm(curl);
+	std::unique_lock<std::mutex> lock(mtx);
+	while (true)
+	{
+		work.wait(lock, [this]{ return pick() != -1 || (stopping && queues[0].empty() && queues[1].empty() && queues[2].empty()); });
+		int i = pick();
+		if (i == -1) break;
+
+		Job *job = queues[i].front();
+		queues[i].pop_front();
+		in_flight[i]++;
+		lock.unlock();
+
+		std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+		if (curl)
+		{
+			/* Reset keeps the share, so the next request reuses a connection */
+			curl_easy_reset(curl);
+			curlDefaults(curl);
+			(*job->run)(curl);
+		}
+		if (job->trace)
+		{
+			Tracer::instance().record("queued", job->trace, job->queued, started);
+			Tracer::instance().record(curl ? method(curl) : "request", job->trace, started, std::chrono::steady_clock::now());
+		}
+		double elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - job->queued).count();
+
+		lock.lock();
+		in_flight[i]--;
+		Samples &s = samples[i];
+		s.ring[s.next] = elapsed;
+		s.next = (s.next + 1) % s.ring.size();
+		s.count++;
+		if (slo[i] > 0 && elapsed > slo[i]) s.over_slo++;
+		if (!replied && curl)
+		{
+			long status = 0;
+			curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+			if (status >= 200 && status < 300 && strcmp(method(curl), "file") != 0)
+			{
+				replied = true;
+				first_reply = std::chrono::steady_clock::now();
+			}
+		}
+		job->ok = curl != nullptr;
+		job->done = true;
+		finished.notify_all();
+		/* The budget of this class is free again, let someone else pick up its queue */
+		work.notify_all();
+	}
+	lock.unlock();
+	if (curl) curl_easy_cleanup(curl);
+}
+/* Bot API method of the last request, for trace spans */
+const char *Outbound::method(CURL *curl)
+{
+	char *url = nullptr;
+	curl_easy_getinfo(curl, CURLINFO_EFFECTIVE_URL, &url);
+	if (!url) return "request";
+	if (strstr(url, "/file/bot")) return "file";
+	const char *name = strrchr(url, '/');
+	return name ? name + 1 : url;
+}
+LatencyStats Outbound::latency(Priority priority)
+{
+	std::vector<double> values;
+	LatencyStats stats = {0, 0, 0, 0, 0};
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		const Samples &s = samples[static_cast<int>(priority)];
+		stats.count = s.count;
+		stats.over_slo = s.over_slo;
+		values.assign(s.ring.begin(), s.ring.begin() + std::min<unsigned long long>(s.count, s.ring.size()));
+	}
+	if (!values.empty())
+	{
+		std::sort(values.begin(), values.end());
+		stats.p50 = values[(values.size() - 1) * 50 / 100];
+		stats.p99 = values[(values.size() - 1) * 99 / 100];
+		stats.max = values.back();
+	}
+	return stats;
+}
+
+/* Response of HttpClient */
+struct HttpResponse
+{
+	CURLcode code;
+	long status;
+	std::string body;
+	bool shared;	// came from the cache or from an identical request made at the same time
+};
+
+/* HTTP client for handlers (third-party APIs and such).
+Connections are pooled and limited per host, successful GET responses are cached for 'ttl' seconds, and identical GETs
+made while the first one is still in flight wait for its response instead of making their own request */
+class HttpClient
+{
+public:
+	HttpClient(unsigned int connections, unsigned int per_host, unsigned int ttl, size_t cache_size, unsigned int timeout);
+	~HttpClient();
+	/* ttl overrides the default for this request, 0 - don't cache */
+	HttpResponse get(const std::string &url);
+	HttpResponse get(const std::string &url, unsigned int ttl);
+	HttpResponse post(const std::string &url, const std::string &body, const std::string &content_type = "application/x-www-form-urlencoded");
+	void clear();
+private:
+	struct Flight
+	{
+		bool done;
+		HttpResponse response;
+		std::exception_ptr error;	// what the request threw, rethrown to everyone waiting for it
+	};
+	struct Cached
+	{
+		HttpResponse response;
+		std::chrono::steady_clock::time_point expires;
+		std::list<std::string>::iterator age;
+	};
+
+	HttpResponse request(const std::string &url, const std::string *body, const std::string &content_type);
+	static std::string host(const std::string &url);
+
+	unsigned int connections;
+	unsigned int per_host;
+	unsigned int ttl;
+	size_t cache_size;
+	unsigned int timeout;
+
+	std::vector<CURL*> idle;
+	unsigned int created;
+	std::map<std::string, unsigned int> hosts;
+	std::unordered_map<std::string, std::shared_ptr<Flight>> flights;
+	std::unordered_map<std::string, Cached> cache;
+	std::list<std::string> ages;	// least recently used first
+	std::mutex mtx;
+	std::condition_variable available;
+};
+
+HttpClient::HttpClient(unsigned int connections, unsigned int per_host, unsigned int ttl, size_t cache_size, unsigned int timeout):connections(std::max(1u, connections)), per_host(per_host), ttl(ttl), cache_size(cache_size), timeout(timeout), created(0)
+{
+}
+HttpClient::~HttpClient()
+{
+	for (CURL *curl:idle) curl_easy_cleanup(curl);
+}
+std::string HttpClient::host(const std::string &url)
+{
+	size_t start = url.find("://");
+	start = start == std::string::npos ? 0 : start + 3;
+	size_t end = url.find_first_of("/?#", start);
+	return url.substr(start, end == std::string::npos ? std::string::npos : end - start);
+}
+void HttpClient::clear()
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	cache.clear();
+	ages.clear();
+}
+HttpResponse HttpClient::get(const std::string &url)
+{
+	return get(url, ttl);
+}
+HttpResponse HttpClient::get(const std::string &url, unsigned int ttl)
+{
+	std::shared_ptr<Flight> flight;
+	{
+		std::unique_lock<std::mutex> lock(mtx);
+		auto hit = ttl > 0 ? cache.find(url) : cache.end();
+		if (hit != cache.end())
+		{
+			if (hit->second.expires > std::chrono::steady_clock::now())
+			{
+				ages.splice(ages.end(), ages, hit->second.age);
+				HttpResponse response = hit->second.response;
+				response.shared = true;
+				return response;
+			}
+			ages.erase(hit->second.age);
+			cache.erase(hit);
+		}
+
+		auto current = flights.find(url);
+		if (current != flights.end())
+		{
+			/* Someone is already asking for it */
+			std::shared_ptr<Flight> leader = current->second;
+			available.wait(lock, [&leader]() { return leader->done; });
+			if (leader->error) std::rethrow_exception(leader->error);
+			HttpResponse response = leader->response;
+			response.shared = true;
+			return response;
+		}
+		flight = std::make_shared<Flight>();
+		flight->done = false;
+		flights[url] = flight;
+	}
+
+	/* Whatever happens, the flight ends and those waiting for it are woken */
+	HttpResponse response = {CURLE_FAILED_INIT, 0, "", false};
+	std::unique_lock<std::mutex> lock(mtx, std::defer_lock);
+	try
+	{
+		response = request(url, nullptr, "");
+		lock.lock();
+		/* Errors and rate limits aren't cached, so the next request tries again */
+		if (ttl > 0 && cache_size > 0 && response.code == CURLE_OK && ((response.status >= 200 && response.status < 300) || response.status == 404))
+		{
+			if (cache.size() >= cache_size)
+			{
+				cache.erase(ages.front());
+				ages.pop_front();
+			}
+			ages.push_back(url);
+			cache[url] = Cached{response, std::chrono::steady_clock::now() + std::chrono::seconds(ttl), std::prev(ages.end())};
+		}
+	}
+	catch (...)
+	{
+		if (!lock.owns_lock()) lock.lock();
+		flight->error = std::current_exception();
+		flight->done = true;
+		flights.erase(url);
+		lock.unlock();
+		available.notify_all();
+		throw;
+	}
+	flight->response = response;
+	flight->done = true;
+	flights.erase(url);
+	lock.unlock();
+	available.notify_all();
+	return response;
+}
+HttpResponse HttpClient::post(const std::string &url, const std::string &body, const std::string &content_type)
+{
+	return request(url, &body, content_type);
+}
+HttpResponse HttpClient::request(const std::string &url, const std::string *body, const std::string &content_type)
+{
+	TraceSpan span("http");
+	std::string name = host(url);
+	CURL *curl = nullptr;
+	{
+		/* A slot for the host first, then a connection */
+		std::unique_lock<std::mutex> lock(mtx);
+		available.wait(lock, [&]() { return (per_host == 0 || hosts[name] < per_host) && (!idle.empty() || created < connections); });
+		hosts[name]++;
+		if (!idle.empty())
+		{
+			curl = idle.back();
+			idle.pop_back();
+		}
+		else created++;
+	}
+	if (!curl) curl = curl_easy_init();
+	else curl_easy_reset(curl);
+
+	HttpResponse response = {CURLE_FAILED_INIT, 0, "", false};
+	struct curl_slist *headers = nullptr;
+	if (curl)
+	{
+		curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+		curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curlWriter);
+		curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response.body);
+		curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+		curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+		curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "");
+		if (timeout > 0) curl_easy_setopt(curl, CURLOPT_TIMEOUT, (long)timeout);
+		if (body)
+		{
+			headers = curl_slist_append(headers, ("Content-Type: " + content_type).c_str());
+			curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+			curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, (long)body->size());
+			curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body->data());
+		}
+		response.code = curl_easy_perform(curl);
+		curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response.status);
+		curl_slist_free_all(headers);
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		if (--hosts[name] == 0) hosts.erase(name);
+		if (curl) idle.push_back(curl);
+		else created--;
+	}
+	available.notify_all();
+	return response;
+}
+
+static unsigned int crc32(const char *data, size_t size)
+{
+	static unsigned int table[256] = {0};
+	static std::once_flag once;
+	std::call_once(once, []()
+	{
+		for (unsigned int i = 0; i < 256; i++)
+		{
+			unsigned int c = i;
+			for (int k = 0; k < 8; k++) c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+			table[i] = c;
+		}
+	});
+	unsigned int crc = 0xFFFFFFFF;
+	for (size_t i = 0; i < size; i++) crc = table[(crc ^ (unsigned char)data[i]) & 0xFF] ^ (crc >> 8);
+	return crc ^ 0xFFFFFFFF;
+}
+
+/* Makes created, renamed and removed files in the directory survive a crash */
+static bool syncDirectory(const std::string &path)
+{
+	int fd = ::open(path.c_str(), O_RDONLY | O_DIRECTORY);
+	if (fd == -1) return false;
+	bool ok = fsync(fd) == 0;
+	close(fd);
+	return ok;
+}
+
+/* Append-only write-ahead log, split into segment files.
+Every record is framed as [length][crc32][type][id][payload], so a torn write at the end of a segment is detected and skipped.
+Appends are written and synced in groups: everything appended while the previous group is being synced goes to disk with one fdatasync */
+class Wal
+{
+public:
+	Wal(std::string path, size_t segment_size, unsigned int group_commit);
+	~Wal();
+	/* Reads the log, compacts it and calls the function for every record that hasn't been acknowledged yet */
+	bool open(const std::function<void(unsigned long long, const std::string&)> &pending);
+	/* Blocks until the record is on disk. Returns its id, or 0 if the log can't be written */
+	unsigned long long append(const std::string &payload);
+	/* Marks the record as done, segments are deleted once all their records and those of older segments are done */
+	void ack(unsigned long long id);
+private:
+	enum RecordType
+	{
+		Append = 1,
+		Ack = 2
+	};
+
+	void writer();
+	void encode(std::string &out, unsigned char type, unsigned long long id, const std::string &payload);
+	std::string segmentName(unsigned long long number) const;
+	bool rotate();
+
+	std::string path;
+	size_t segment_size;
+	unsigned int group_commit;
+	int fd;
+	unsigned long long segment;
+	size_t written;
+	unsigned long long next_id;
+	/* Segment of every record that hasn't been acknowledged, and the number of such records in every segment that is still on disk */
+	std::map<unsigned long long, unsigned long long> record_segment;
+	std::map<unsigned long long, size_t> live;
+	std::string pending;
+	std::vector<unsigned long long> pending_ids;
+	std::vector<unsigned long long> pending_acks;
+	unsigned long long batch;
+	unsigned long long committed;
+	bool opened;
+	bool failed;
+	bool stopping;
+	std::mutex mtx;
+	std::condition_variable wake;
+	std::condition_variable done;
+	std::thread thread;
+};
+
+Wal::Wal(std::string path, size_t segment_size, unsigned int group_commit):path(path), segment_size(segment_size), group_commit(group_commit), fd(-1), segment(0), written(0), next_id(1), batch(1), committed(0), opened(false), failed(false), stopping(false)
+{
+}
+Wal::~Wal()
+{
+	if (thread.joinable())
+	{
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			stopping = true;
+		}
+		wake.notify_all();
+		thread.join();
+	}
+	if (fd != -1) close(fd);
+}
+std::string Wal::segmentName(unsigned long long number) const
+{
+	char name[32];
+	snprintf(name, sizeof(name), "/%012llu.wal", number);
+	return path + name;
+}
+void Wal::encode(std::string &out, unsigned char type, unsigned long long id, const std::string &payload)
+{
+	unsigned int length = 1 + sizeof(id) + payload.size();
+	size_t start = out.size();
+	out.resize(start + 8);
+	out += (char)type;
+	out.append(reinterpret_cast<const char*>(&id), sizeof(id));
+	out += payload;
+	unsigned int crc = crc32(out.data() + start + 8, length);
+	memcpy(&out[start], &length, 4);
+	memcpy(&out[start + 4], &crc, 4);
+}
+bool Wal::rotate()
+{
+	if (fd != -1) close(fd);
+	segment++;
+	written = 0;
+	fd = ::open(segmentName(segment).c_str(), O_WRONLY | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR);
+	/* Synced records are of no use if the file itself is lost in a crash */
+	return fd != -1 && syncDirectory(path);
+}
+bool Wal::open(const std::function<void(unsigned long long, const std::string&)> &pending)
+{
+	/* Read all segments in order */
+	std::vector<unsigned long long> segments;
+	DIR *dir = opendir(path.c_str());
+	if (!dir) return false;
+	struct dirent *ent;
+	while ((ent = readdir(dir)) != NULL)
+	{
+		unsigned long long number;
+		char tail[8];
+		if (sscanf(ent->d_name, "%12llu.%4s", &number, tail) == 2 && strcmp(tail, "wal") == 0) segments.push_back(number);
+	}
+	closedir(dir);
+	std::sort(segments.begin(), segments.end());
+
+	std::map<unsigned long long, std::string> records;
+	for (unsigned long long number:segments)
+	{
+		std::ifstream file(segmentName(number), std::ios_base::in | std::ios_base::binary);
+		std::string data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+		size_t offset = 0;
+		while (offset + 8 + 1 + sizeof(unsigned long long) <= data.size())
+		{
+			unsigned int length, crc;
+			memcpy(&length, &data[offset], 4);
+			memcpy(&crc, &data[offset + 4], 4);
+			if (length < 1 + sizeof(unsigned long long) || offset + 8 + length > data.size()) break;
+			if (crc32(&data[offset + 8], length) != crc) break;
+			unsigned char type = data[offset + 8];
+			unsigned long long id;
+			memcpy(&id, &data[offset + 9], sizeof(id));
+			if (type == Append) records[id] = data.substr(offset + 9 + sizeof(id), length - 1 - sizeof(id));
+			else if (type == Ack) records.erase(id);
+			offset += 8 + length;
+		}
+		segment = number;
+	}
+
+	/* Pending records are written again to a fresh segment and the old ones are removed */
+	if (!rotate()) return false;
+	opened = true;
+	thread = std::thread(&Wal::writer, this);
+	std::vector<std::pair<unsigned long long, std::string> > replay;
+	for (const auto& record:records)
+	{
+		unsigned long long id = append(record.second);
+		if (id == 0) return false;
+		replay.push_back(std::make_pair(id, record.second));
+	}
+	for (unsigned long long number:segments)
+	{
+		unlink(segmentName(number).c_str());
+	}
+	if (!segments.empty()) syncDirectory(path);
+	for (const auto& record:replay)
+	{
+		pending(record.first, record.second);
+	}
+	return true;
+}
+unsigned long long Wal::append(const std::string &payload)
+{
+	std::unique_lock<std::mutex> lock(mtx);
+	if (failed || !opened) return 0;
+	unsigned long long id = next_id++;
+	encode(pending, Append, id, payload);
+	pending_ids.push_back(id);
+	unsigned long long mine = batch;
+	wake.notify_one();
+	done.wait(lock, [this, mine]{ return committed >= mine || failed; });
+	return failed ? 0 : id;
+}
+void Wal::ack(unsigned long long id)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	if (failed || !opened) return;
+	/* Acknowledgements aren't waited for: if one is lost, the record is simply sent again */
+	encode(pending, Ack, id, "");
+	pending_acks.push_back(id);
+	wake.notify_one();
+}
+void Wal::writer()
+{
+	std::string writing;
+	std::vector<unsigned long long> ids, acks;
+	std::unique_lock<std::mutex> lock(mtx);
+	while (true)
+	{
+		wake.wait(lock, [this]{ return !pending.empty() || stopping; });
+		if (pending.empty()) break;
+		if (group_commit > 0 && !stopping)
+		{
+			/* Give concurrent senders a moment to join this group */
+			lock.unlock();
+			std::this_thread::sleep_for(std::chrono::milliseconds(group_commit));
+			lock.lock();
+		}
+		writing.swap(pending);
+		ids.swap(pending_ids);
+		acks.swap(pending_acks);
+		unsigned long long current = batch++;
+		lock.unlock();
+
+		bool ok = true;
+		if (written >= segment_size) ok = rotate();
+		size_t offset = 0;
+		while (ok && offset < writing.size())
+		{
+			ssize_t result = write(fd, writing.data() + offset, writing.size() - offset);
+			if (result < 0) ok = false;
+			else offset += result;
+		}
+		if (ok && !ids.empty()) ok = fdatasync(fd) == 0;
+		written += writing.size();
+		writing.clear();
+
+		lock.lock();
+		if (!ok)
+		{
+			std::cerr << "\t| Error! Can't write to the outbound queue in " << path << "." << std::endl;
+			failed = true;
+		}
+		live.insert(std::make_pair(segment, 0));
+		for (unsigned long long id:ids)
+		{
+			record_segment[id] = segment;
+			live[segment]++;
+		}
+		for (unsigned long long id:acks)
+		{
+			auto it = record_segment.find(id);
+			if (it == record_segment.end()) continue;
+			live[it->second]--;
+			record_segment.erase(it);
+		}
+		/* Segments are removed oldest first: a segment also holds acknowledgements of records in older ones,
+		which would be sent again after a restart if it went before them */
+		bool removed = false;
+		while (live.begin()->first != segment && live.begin()->second == 0)
+		{
+			unlink(segmentName(live.begin()->first).c_str());
+			live.erase(live.begin());
+			removed = true;
+		}
+		if (removed)
+		{
+			lock.unlock();
+			syncDirectory(path);
+			lock.lock();
+		}
+		ids.clear();
+		acks.clear();
+		committed = current;
+		done.notify_all();
+	}
+}
+
+/* Per-chat state for the handlers, i.e. the step of a conversation.
+Chats are spread over shards with their own lock, so handlers of different chats rarely wait for each other.
+Each shard is an open-addressing hash table with linear probing. An entry takes 32 bytes,
+values up to 16 bytes are stored inside the entry and longer ones in a separate allocation */
+class SessionStore
+{
+public:
+	/* ttl - seconds since the last access after which a session expires (0 - never),
+	capacity - maximum number of sessions, the least recently used ones are evicted (0 - unlimited) */
+	SessionStore(unsigned int ttl = 0, size_t capacity = 0):ttl(ttl), capacity(capacity) {}
+	~SessionStore()
+	{
+		for (auto& shard:shards)
+		{
+			for (auto& entry:shard.entries) release(entry);
+		}
+	}
+
+	bool get(long long chat_id, std::string &value)
+	{
+		Shard &shard = shardOf(chat_id);
+		std::lock_guard<std::mutex> lock(shard.mtx);
+		size_t i;
+		if (!find(shard, chat_id, i)) return false;
+		Entry &entry = shard.entries[i];
+		unsigned int now = time(nullptr);
+		if (expired(entry, now))
+		{
+			remove(shard, i);
+			return false;
+		}
+		entry.touched = now;
+		value.assign(payload(entry), entry.size);
+		return true;
+	}
+	std::string get(long long chat_id)
+	{
+		std::string value;
+		get(chat_id, value);
+		return value;
+	}
+	void set(long long chat_id, const std::string &value)
+	{
+		set(chat_id, value, time(nullptr));
+	}
+	bool erase(long long chat_id)
+	{
+		Shard &shard = shardOf(chat_id);
+		std::lock_guard<std::mutex> lock(shard.mtx);
+		size_t i;
+		if (!find(shard, chat_id, i)) return false;
+		remove(shard, i);
+		return true;
+	}
+	size_t size()
+	{
+		size_t result = 0;
+		for (auto& shard:shards)
+		{
+			std::lock_guard<std::mutex> lock(shard.mtx);
+			result += shard.used;
+		}
+		return result;
+	}
+	/* Removes all expired sessions */
+	void expire()
+	{
+		if (ttl == 0) return;
+		unsigned int now = time(nullptr);
+		for (auto& shard:shards)
+		{
+			std::lock_guard<std::mutex> lock(shard.mtx);
+			for (size_t i = 0; i < shard.entries.size(); )
+			{
+				/* Removal shifts the next entries back, so the same slot is checked again */
+				if (shard.entries[i].touched != 0 && expired(shard.entries[i], now)) remove(shard, i);
+				else i++;
+			}
+		}
+	}
+
+	/* Snapshot format: "TGSS", number of sessions, then [chat_id][last access][size][value] for every session.
+	Shards are copied one at a time, so handlers only wait for the copy of their own shard and never for the disk */
+	bool save(const std::string &path)
+	{
+		std::string data(12, '\0');
+		unsigned long long count = 0;
+		for (auto& shard:shards)
+		{
+			std::lock_guard<std::mutex> lock(shard.mtx);
+			for (const auto& entry:shard.entries)
+			{
+				if (entry.touched == 0) continue;
+				data.append(reinterpret_cast<const char*>(&entry.key), 8);
+				data.append(reinterpret_cast<const char*>(&entry.touched), 4);
+				data.append(reinterpret_cast<const char*>(&entry.size), 4);
+				data.append(payload(entry), entry.size);
+				count++;
+			}
+		}
+		memcpy(&data[0], "TGSS", 4);
+		memcpy(&data[4], &count, 8);
+
+		std::string temp = path + ".tmp";
+		int fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+		bool ok = fd != -1;
+		size_t offset = 0;
+		while (ok && offset < data.size())
+		{
+			ssize_t result = write(fd, data.data() + offset, data.size() - offset);
+			if (result < 0) ok = false;
+			else offset += result;
+		}
+		if (ok) ok = fsync(fd) == 0;
+		if (fd != -1) close(fd);
+		if (ok) ok = std::rename(temp.c_str(), path.c_str()) == 0;
+		if (ok)
+		{
+			size_t slash = path.rfind('/');
+			ok = syncDirectory(slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash));
+		}
+		if (!ok) std::cerr << "\t| Error! Can't save sessions to " << path << "." << std::endl;
+		return ok;
+	}
+	bool load(const std::string &path)
+	{
+		int fd = ::open(path.c_str(), O_RDONLY);
+		if (fd == -1) return false;
+		struct stat info;
+		bool ok = false;
+		if (fstat(fd, &info) == 0 && info.st_size >= 12)
+		{
+			size_t total = info.st_size;
+			const char *data = static_cast<const char*>(mmap(nullptr, total, PROT_READ, MAP_PRIVATE, fd, 0));
+			if (data != MAP_FAILED)
+			{
+				unsigned long long count;
+				memcpy(&count, data + 4, 8);
+				ok = memcmp(data, "TGSS", 4) == 0;
+				const char *in = data + 12, *end = data + total;
+				unsigned int now = time(nullptr);
+				for (unsigned long long i = 0; ok && i < count; i++)
+				{
+					long long key;
+					unsigned int touched, size;
+					if (end - in < 16) break;
+					memcpy(&key, in, 8);
+					memcpy(&touched, in + 8, 4);
+					memcpy(&size, in + 12, 4);
+					if ((size_t)(end - in - 16) < size) break;
+					/* 0 marks a free slot, such an entry can only come from a damaged file */
+					if (touched != 0 && (ttl == 0 || now - touched <= ttl)) set(key, std::string(in + 16, size), touched);
+					in += 16 + size;
+				}
+				munmap(const_cast<char*>(data), total);
+			}
+		}
+		close(fd);
+		return ok;
+	}
+private:
+	static const size_t shard_count = 64;
+	static const unsigned int inline_size = 16;
+
+	struct Entry
+	{
+		long long key;
+		unsigned int touched;	// unix time of the last access, 0 - free slot
+		unsigned int size;
+		union
+		{
+			char local[inline_size];
+			char *heap;
+		};
+	};
+	struct Shard
+	{
+		std::vector<Entry> entries;
+		size_t used = 0;
+		std::mutex mtx;
+	};
+
+	static unsigned long long hash(long long key)
+	{
+		/* splitmix64 finalizer, chat ids are far from random */
+		unsigned long long x = key;
+		x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+		return x ^ (x >> 31);
+	}
+	Shard &shardOf(long long key) { return shards[hash(key) >> 58]; }
+	static const char *payload(const Entry &entry) { return entry.size > inline_size ? entry.heap : entry.local; }
+	static void release(Entry &entry)
+	{
+		if (entry.touched != 0 && entry.size > inline_size) delete[] entry.heap;
+		entry.touched = 0;
+	}
+	bool expired(const Entry &entry, unsigned int now) const { return ttl != 0 && now - entry.touched > ttl; }
+
+	bool find(Shard &shard, long long key, size_t &i)
+	{
+		if (shard.entries.empty()) return false;
+		size_t mask = shard.entries.size() - 1;
+		for (i = hash(key) & mask; shard.entries[i].touched != 0; i = (i + 1) & mask)
+		{
+			if (shard.entries[i].key == key) return true;
+		}
+		return false;
+	}
+	/* Backward shift deletion, so lookups never need tombstones */
+	void remove(Shard &shard, size_t i)
+	{
+		size_t mask = shard.entries.size() - 1;
+		release(shard.entries[i]);
+		shard.used--;
+		for (size_t j = (i + 1) & mask; shard.entries[j].touched != 0; j = (j + 1) & mask)
+		{
+			size_t home = hash(shard.entries[j].key) & mask;
+			/* The entry at j can move to i if its home slot is not between i and j */
+			if (((j - home) & mask) >= ((j - i) & mask))
+			{
+				shard.entries[i] = shard.entries[j];
+				shard.entries[j].touched = 0;
+				i = j;
+			}
+		}
+	}
+	void grow(Shard &shard)
+	{
+		std::vector<Entry> old(shard.entries.empty() ? 16 : shard.entries.size() * 2);
+		for (auto& entry:old) entry.touched = 0;
+		old.swap(shard.entries);
+		size_t mask = shard.entries.size() - 1;
+		for (const auto& entry:old)
+		{
+			if (entry.touched == 0) continue;
+			size_t i = hash(entry.key) & mask;
+			while (shard.entries[i].touched != 0) i = (i + 1) & mask;
+			shard.entries[i] = entry;
+		}
+	}
+	/* Approximate LRU: the oldest of a few sampled sessions is evicted */
+	void evict(Shard &shard)
+	{
+		static thread_local std::mt19937 random(std::random_device{}());
+		size_t oldest = shard.entries.size();
+		for (unsigned int sample = 0; sample < 8; )
+		{
+			size_t i = random() & (shard.entries.size() - 1);
+			if (shard.entries[i].touched == 0) continue;
+			if (oldest == shard.entries.size() || shard.entries[i].touched < shard.entries[oldest].touched) oldest = i;
+			sample++;
+		}
+		remove(shard, oldest);
+	}
+	void set(long long chat_id, const std::string &value, unsigned int touched)
+	{
+		/* The value is copied before the table is changed, so a failed allocation leaves the table as it was */
+		std::unique_ptr<char[]> heap;
+		if (value.size() > inline_size)
+		{
+			heap.reset(new char[value.size()]);
+			memcpy(heap.get(), value.data(), value.size());
+		}
+
+		Shard &shard = shardOf(chat_id);
+		std::lock_guard<std::mutex> lock(shard.mtx);
+		size_t i = 0;
+		if (!find(shard, chat_id, i))
+		{
+			if (capacity > 0 && shard.used > 0 && shard.used >= (capacity + shard_count - 1) / shard_count) evict(shard);
+			if ((shard.used + 1) * 10 > shard.entries.size() * 7) grow(shard);
+			find(shard, chat_id, i);
+			shard.used++;
+		}
+		else if (shard.entries[i].size > inline_size) delete[] shard.entries[i].heap;
+
+		Entry &entry = shard.entries[i];
+		entry.key = chat_id;
+		entry.touched = touched;
+		entry.size = value.size();
+		if (heap) entry.heap = heap.release();
+		else memcpy(entry.local, value.data(), entry.size);
+	}
+
+	unsigned int ttl;
+	size_t capacity;
+	std::array<Shard, shard_count> shards;
+};
+
+/* State of the polling circuit breaker */
+enum class Breaker
+{
+	Closed,		// polling as usual
+	Open,		// too many failed polls in a row, no polls until the pause ends
+	HalfOpen	// the pause is over, one trial poll decides whether to close or to open again
+};
+
+/* Parameters chosen by the polling controller */
+struct PollingStats
+{
+	unsigned int limit;
+	unsigned int delay;		// milliseconds before the next poll
+	unsigned int backlog;	// handlers running
+	double batch;			// average number of updates per poll
+	unsigned int failures;	// failed polls in a row
+	Breaker breaker;
+	unsigned long long polls;
+	unsigned long long errors;
+};
+
+/* Chooses getUpdates limit and the delay between polls.
+Full batches raise the limit and are followed by an immediate poll, a handler backlog lowers the limit and slows polling down.
+Failures are retried with exponential backoff and jitter, and after too many failures in a row the circuit breaker
+stops polling for retryTimeout seconds, after which a single poll decides whether to close it.
+Without 'adaptive' the limit and the delays are the configured ones */
+class PollController
+{
+public:
+	/* limit - the most updates one poll may fetch. Adaptive polling starts lower and grows toward it while batches come full */
+	PollController(bool adaptive, unsigned int limit, unsigned int interval, unsigned int retry_timeout, unsigned int max_backlog, unsigned int breaker_threshold):
+		adaptive(adaptive), max_limit(std::max(1u, std::min(limit, 100u))), min_limit(adaptive ? std::min(max_limit, 10u) : max_limit), interval(interval), retry_timeout(retry_timeout), max_backlog(max_backlog), breaker_threshold(breaker_threshold),
+		random(std::random_device{}())
+	{
+		current = {min_limit, 0, 0, 0, 0, Breaker::Closed, 0, 0};
+	}
+
+	/* Called before every poll. The first poll after the breaker's pause is the trial one, it fetches a single update */
+	unsigned int limit()
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		if (current.breaker == Breaker::Open) current.breaker = Breaker::HalfOpen;
+		return current.breaker == Breaker::HalfOpen ? 1 : current.limit;
+	}
+	std::chrono::milliseconds delay()
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		return std::chrono::milliseconds(current.delay);
+	}
+	PollingStats stats()
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		return current;
+	}
+
+	void success(size_t updates, size_t backlog)
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		current.polls++;
+		current.failures = 0;
+		current.breaker = Breaker::Closed;
+		current.backlog = backlog;
+		current.batch = current.polls == 1 ? updates : current.batch * 0.7 + updates * 0.3;
+		current.delay = interval * 1000;
+		if (!adaptive) return;
+
+		if (max_backlog > 0 && backlog > max_backlog)
+		{
+			/* Handlers can't keep up, fetch less and give them time */
+			current.limit = std::max(1u, current.limit / 2);
+			current.delay = std::max<unsigned int>(current.delay, std::min<size_t>((backlog - max_backlog) * 10, 5000));
+		}
+		else if (updates >= current.limit)
+		{
+			/* There are probably more updates waiting */
+			current.limit = std::min(max_limit, std::max(current.limit * 2, min_limit));
+			current.delay = 0;
+		}
+		else
+		{
+			current.limit = std::max(min_limit, std::min(max_limit, static_cast<unsigned int>(current.batch * 2 + 1)));
+		}
+	}
+	void failure()
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		current.polls++;
+		current.errors++;
+		current.failures++;
+		if (!adaptive)
+		{
+			current.delay = retry_timeout * 1000;
+			return;
+		}
+
+		unsigned int cap = std::max(1u, retry_timeout) * 1000;
+		if (current.breaker == Breaker::HalfOpen || (breaker_threshold > 0 && current.failures >= breaker_threshold))
+		{
+			/* Opens after too many failures, or again if the trial poll failed */
+			current.breaker = Breaker::Open;
+			current.delay = std::uniform_int_distribution<unsigned int>(cap / 2, cap)(random);
+		}
+		else
+		{
+			/* Full jitter, so that instances restarted together don't retry together */
+			unsigned int limit = std::min<unsigned long long>(cap, 500ull << std::min(current.failures, 20u));
+			current.delay = std::uniform_int_distribution<unsigned int>(0, limit)(random);
+		}
+	}
+private:
+	bool adaptive;
+	unsigned int max_limit;
+	unsigned int min_limit;
+	unsigned int interval;
+	unsigned int retry_timeout;
+	unsigned int max_backlog;
+	unsigned int breaker_threshold;
+	PollingStats current;
+	std::mt19937 random;
+	std::mutex mtx;
+};
+
+/* Ingest/dispatch split: one process polls Telegram and forwards updates to worker processes.
+Messages on the wire are frames [length][type][payload] with big-endian integers:
+Hello carries the worker name, Batch carries [seq][length][update] records and Ack carries the seqs of handled updates */
+namespace cluster
+{
+	enum FrameType
+	{
+		Hello = 1,
+		Batch = 2,
+		Ack = 3
+	};
+
+	static const size_t max_frame = 64 << 20;
+
+	inline void put32(std::string &out, unsigned int value)
+	{
+		char bytes[4] = {(char)(value >> 24), (char)(value >> 16), (char)(value >> 8), (char)value};
+		out.append(bytes, 4);
+	}
+	inline void put64(std::string &out, unsigned long long value)
+	{
+		put32(out, value >> 32);
+		put32(out, value & 0xFFFFFFFF);
+	}
+	inline unsigned int get32(const char *data)
+	{
+		const unsigned char *bytes = reinterpret_cast<const unsigned char*>(data);
+		return (unsigned int)bytes[0] << 24 | (unsigned int)bytes[1] << 16 | (unsigned int)bytes[2] << 8 | bytes[3];
+	}
+	inline unsigned long long get64(const char *data)
+	{
+		return (unsigned long long)get32(data) << 32 | get32(data + 4);
+	}
+
+	/* Frames are built in place, the length is filled in when the payload is complete */
+	inline size_t beginFrame(std::string &out, unsigned char type)
+	{
+		size_t start = out.size();
+		put32(out, 0);
+		out += (char)type;
+		return start;
+	}
+	inline void endFrame(std::string &out, size_t start)
+	{
+		unsigned int length = out.size() - start - 4;
+		for (int i = 0; i < 4; i++) out[start + i] = (char)(length >> (24 - 8 * i));
+	}
+
+	/* Returns the size of the first complete frame in the buffer, 0 if it isn't complete yet and -1 if it is broken */
+	inline long long frameSize(const std::string &in, size_t pos)
+	{
+		if (in.size() - pos < 4) return 0;
+		size_t length = get32(in.data() + pos);
+		if (length == 0 || length > max_frame) return -1;
+		if (in.size() - pos < length + 4) return 0;
+		return length + 4;
+	}
+
+	inline unsigned long long hash(unsigned long long x)
+	{
+		x += 0x9e3779b97f4a7c15ULL;
+		x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+		return x ^ (x >> 31);
+	}
+	inline unsigned long long hash(const std::string &text)
+	{
+		unsigned long long h = 14695981039346656037ULL;
+		for (unsigned char c:text) h = (h ^ c) * 1099511628211ULL;
+		return hash(h);
+	}
+
+	inline bool sendAll(int fd, const char *data, size_t size)
+	{
+		while (size > 0)
+		{
+			ssize_t n = ::send(fd, data, size, MSG_NOSIGNAL);
+			if (n < 0 && errno == EINTR) continue;
+			if (n <= 0) return false;
+			data += n;
+			size -= n;
+		}
+		return true;
+	}
+
+	/* Opens "unix:/path/to/socket" or "tcp:host:port" ("host:port" works too) for listening or connects to it.
+	Returns the socket or -1 */
+	inline int open(const std::string &address, bool server)
+	{
+		int fd = -1;
+		if (address.compare(0, 5, "unix:") == 0)
+		{
+			std::string path = address.substr(5);
+			struct sockaddr_un addr;
+			if (path.empty() || path.size() >= sizeof(addr.sun_path)) return -1;
+			memset(&addr, 0, sizeof(addr));
+			addr.sun_family = AF_UNIX;
+			memcpy(addr.sun_path, path.c_str(), path.size());
+			fd = socket(AF_UNIX, SOCK_STREAM, 0);
+			if (fd == -1) return -1;
+			if (server) unlink(path.c_str());
+			if (server ? bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || ::listen(fd, 128) != 0 : connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+			{
+				close(fd);
+				return -1;
+			}
+			return fd;
+		}
+
+		std::string host = address.compare(0, 4, "tcp:") == 0 ? address.substr(4) : address;
+		size_t colon = host.rfind(':');
+		if (colon == std::string::npos) return -1;
+		std::string port = host.substr(colon + 1);
+		host.resize(colon);
+		struct addrinfo hints, *list = nullptr;
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_flags = server ? AI_PASSIVE : 0;
+		if (getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &list) != 0) return -1;
+		for (struct addrinfo *ai = list; ai != nullptr && fd == -1; ai = ai->ai_next)
+		{
+			fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+			if (fd == -1) continue;
+			int on = 1;
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+			if (server) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+			if (server ? bind(fd, ai->ai_addr, ai->ai_addrlen) != 0 || ::listen(fd, 128) != 0 : connect(fd, ai->ai_addr, ai->ai_addrlen) != 0)
+			{
+				close(fd);
+				fd = -1;
+			}
+		}
+		freeaddrinfo(list);
+		return fd;
+	}
+}
+
+/* State of the dispatcher */
+struct ClusterStats
+{
+	unsigned int workers;
+	unsigned long long pending;		// dispatched, but not handled yet
+	unsigned long long inflight;	// sent to workers, but not acknowledged yet
+	unsigned long long dispatched;
+	unsigned long long handled;
+	unsigned long long redelivered;	// sent again after their worker was gone
+};
+
+/* Receiving side of the ingest/dispatch split.
+Workers connect to it and introduce themselves by name, every name takes a set of points on a hash ring and an update goes to
+the worker that owns its chat. While a chat has updates in flight, the next ones follow them to the same worker even if the ring
+has changed, so the order within a chat is kept when workers join or leave. Updates of a worker that is gone are sent again to the new owners.
+Every worker has a window of unacknowledged updates, and dispatch() blocks once max_pending updates are waiting */
+class Dispatcher
+{
+public:
+	Dispatcher(const std::string &address, unsigned int batch, unsigned int window, size_t max_pending);
+	~Dispatcher();
+	bool listen();
+	/* The key is the chat of the update, the update itself is sent as is */
+	void dispatch(long long key, std::string update);
+	size_t backlog();
+	ClusterStats stats();
+	/* Stops forwarding and returns the updates that haven't been handled yet, in the order they came */
+	std::vector<std::string> shutdown();
+private:
+	static const unsigned int ring_points = 64;
+
+	struct Item
+	{
+		unsigned long long seq;
+		long long key;
+		std::string update;
+	};
+	struct Worker
+	{
+		int fd;
+		std::string name;
+		bool joined;
+		bool dead;
+		std::string in;
+		std::string out;
+		size_t sent;
+		std::map<unsigned long long, Item> inflight;
+		std::deque<Item> waiting;
+	};
+	/* Worker that has updates of a chat in flight, and how many */
+	struct Owner
+	{
+		Worker *worker;
+		size_t count;
+	};
+
+	void loop();
+	void route(Item item);
+	void join(Worker *worker);
+	void remove(Worker *worker);
+	void receive(Worker *worker);
+	void fill(Worker *worker);
+	void transmit(Worker *worker);
+
+	std::string address;
+	unsigned int batch;
+	unsigned int window;
+	size_t max_pending;
+	int listener;
+	int wake[2];
+	unsigned long long next_seq;
+
+	/* Owned by the I/O thread */
+	std::vector<std::unique_ptr<Worker>> workers;
+	std::map<unsigned long long, Worker*> ring;
+	std::unordered_map<long long, Owner> owners;
+	std::deque<Item> unassigned;
+
+	std::mutex mtx;
+	std::condition_variable space;
+	std::deque<Item> incoming;
+	size_t pending;
+	bool stopping;
+	ClusterStats current;
+	std::thread thread;
+};
+
+Dispatcher::Dispatcher(const std::string &address, unsigned int batch, unsigned int window, size_t max_pending):address(address), batch(std::max(1u, batch)), window(std::max(1u, window)), max_pending(std::max<size_t>(1, max_pending)), listener(-1), next_seq(1), pending(0), stopping(false)
+{
+	wake[0] = wake[1] = -1;
+	current = {0, 0, 0, 0, 0, 0};
+}
+Dispatcher::~Dispatcher()
+{
+	shutdown();
+	for (auto& worker:workers) close(worker->fd);
+	if (listener != -1)
+	{
+		close(listener);
+		if (address.compare(0, 5, "unix:") == 0) unlink(address.c_str() + 5);
+	}
+	if (wake[0] != -1) close(wake[0]);
+	if (wake[1] != -1) close(wake[1]);
+}
+bool Dispatcher::listen()
+{
+	listener = cluster::open(address, true);
+	if (listener == -1 || pipe(wake) != 0)
+	{
+		std::cerr << "\t| Error! Can't listen on " << address << "." << std::endl;
+		return false;
+	}
+	fcntl(listener, F_SETFL, fcntl(listener, F_GETFL) | O_NONBLOCK);
+	fcntl(wake[0], F_SETFL, fcntl(wake[0], F_GETFL) | O_NONBLOCK);
+	fcntl(wake[1], F_SETFL, fcntl(wake[1], F_GETFL) | O_NONBLOCK);
+	thread = std::thread(&Dispatcher::loop, this);
+	return true;
+}
+void Dispatcher::dispatch(long long key, std::string update)
+{
+	std::unique_lock<std::mutex> lock(mtx);
+	space.wait(lock, [this]() { return pending < max_pending || stopping; });
+	if (stopping) return;
+	incoming.push_back(Item{0, key, std::move(update)});
+	pending++;
+	current.dispatched++;
+	if (incoming.size() == 1)
+	{
+		char c = 0;
+		if (write(wake[1], &c, 1) < 0) {}
+	}
+}
+std::vector<std::string> Dispatcher::shutdown()
+{
+	if (thread.joinable())
+	{
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			stopping = true;
+		}
+		space.notify_all();
+		char c = 0;
+		if (write(wake[1], &c, 1) < 0) {}
+		thread.join();
+	}
+
+	std::map<unsigned long long, std::string> left;
+	for (auto& item:unassigned) left[item.seq] = std::move(item.update);
+	for (auto& worker:workers)
+	{
+		for (auto& entry:worker->inflight) left[entry.first] = std::move(entry.second.update);
+		for (auto& item:worker->waiting) left[item.seq] = std::move(item.update);
+		worker->inflight.clear();
+		worker->waiting.clear();
+	}
+	unassigned.clear();
+	owners.clear();
+
+	std::vector<std::string> updates;
+	for (auto& entry:left) updates.push_back(std::move(entry.second));
+	std::lock_guard<std::mutex> lock(mtx);
+	for (auto& item:incoming) updates.push_back(std::move(item.update));
+	incoming.clear();
+	pending = 0;
+	return updates;
+}
+size_t Dispatcher::backlog()
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	return pending;
+}
+ClusterStats Dispatcher::stats()
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	ClusterStats result = current;
+	result.pending = pending;
+	return result;
+}
+void Dispatcher::route(Item item)
+{
+	auto owner = owners.find(item.key);
+	Worker *worker = nullptr;
+	if (owner != owners.end()) worker = owner->second.worker;
+	else if (!ring.empty())
+	{
+		auto point = ring.lower_bound(cluster::hash((unsigned long long)item.key));
+		worker = (point == ring.end() ? ring.begin() : point)->second;
+	}
+	if (!worker)
+	{
+		unassigned.push_back(std::move(item));
+		return;
+	}
+	if (owner != owners.end()) owner->second.count++;
+	else owners.emplace(item.key, Owner{worker, 1});
+	worker->waiting.push_back(std::move(item));
+}
+void Dispatcher::join(Worker *worker)
+{
+	for (auto& other:workers)
+	{
+		if (other.get() != worker && other->joined && other->name == worker->name) worker->name += "#" + std::to_string(worker->fd);
+	}
+	worker->joined = true;
+	for (unsigned int i = 0; i < ring_points; i++)
+	{
+		ring[cluster::hash(worker->name + "#" + std::to_string(i))] = worker;
+	}
+	std::cout << "\tWorker " << worker->name << " joined." << std::endl;
+
+	/* Updates that came while there were no workers */
+	std::deque<Item> held;
+	held.swap(unassigned);
+	for (auto& item:held) route(std::move(item));
+}
+void Dispatcher::remove(Worker *worker)
+{
+	close(worker->fd);
+	for (auto point = ring.begin(); point != ring.end();)
+	{
+		if (point->second == worker) point = ring.erase(point);
+		else ++point;
+	}
+	for (auto owner = owners.begin(); owner != owners.end();)
+	{
+		if (owner->second.worker == worker) owner = owners.erase(owner);
+		else ++owner;
+	}
+
+	/* Everything it had goes to the new owners in the original order, updates it handled but didn't acknowledge are handled twice */
+	std::vector<Item> orphans;
+	for (auto& entry:worker->inflight) orphans.push_back(std::move(entry.second));
+	for (auto& item:worker->waiting) orphans.push_back(std::move(item));
+	if (worker->joined)
+	{
+		std::cout << "\tWorker " << worker->name << " left, " << orphans.size() << " updates go to other workers." << std::endl;
+	}
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		current.redelivered += worker->inflight.size();
+	}
+	for (auto& item:orphans) route(std::move(item));
+
+	workers.erase(std::find_if(workers.begin(), workers.end(), [worker](const std::unique_ptr<Worker> &w) { return w.get() == worker; }));
+}
+void Dispatcher::receive(Worker *worker)
+{
+	char buffer[65536];
+	while (true)
+	{
+		ssize_t n = recv(worker->fd, buffer, sizeof(buffer), 0);
+		if (n > 0) worker->in.append(buffer, n);
+		else if (n < 0 && errno == EINTR) continue;
+		else
+		{
+			if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) worker->dead = true;
+			break;
+		}
+	}
+
+	size_t pos = 0, handled = 0;
+	long long size;
+	while ((size = cluster::frameSize(worker->in, pos)) > 0)
+	{
+		const char *frame = worker->in.data() + pos + 5;
+		size_t length = size - 5;
+		unsigned char type = worker->in[pos + 4];
+		if (type == cluster::Hello && !worker->joined)
+		{
+			worker->name.assign(frame, length);
+			join(worker);
+		}
+		else if (type == cluster::Ack)
+		{
+			for (size_t i = 0; i + 8 <= length; i += 8)
+			{
+				auto entry = worker->inflight.find(cluster::get64(frame + i));
+				if (entry == worker->inflight.end()) continue;
+				auto owner = owners.find(entry->second.key);
+				if (owner != owners.end() && --owner->second.count == 0) owners.erase(owner);
+				worker->inflight.erase(entry);
+				handled++;
+			}
+		}
+		pos += size;
+	}
+	if (size < 0) worker->dead = true;
+	worker->in.erase(0, pos);
+
+	if (handled > 0)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			pending -= handled;
+			current.handled += handled;
+		}
+		space.notify_all();
+	}
+}
+void Dispatcher::fill(Worker *worker)
+{
+	/* A frame carries up to 'batch' updates, the window limits how many a worker holds at once */
+	while (!worker->waiting.empty() && worker->inflight.size() < window)
+	{
+		size_t start = cluster::beginFrame(worker->out, cluster::Batch);
+		for (unsigned int i = 0; i < batch && !worker->waiting.empty() && worker->inflight.size() < window; i++)
+		{
+			Item &item = worker->waiting.front();
+			cluster::put64(worker->out, item.seq);
+			cluster::put32(worker->out, item.update.size());
+			worker->out += item.update;
+			unsigned long long seq = item.seq;
+			worker->inflight.emplace(seq, std::move(item));
+			worker->waiting.pop_front();
+		}
+		cluster::endFrame(worker->out, start);
+	}
+}
+void Dispatcher::transmit(Worker *worker)
+{
+	while (worker->sent < worker->out.size())
+	{
+		ssize_t n = ::send(worker->fd, worker->out.data() + worker->sent, worker->out.size() - worker->sent, MSG_NOSIGNAL);
+		if (n > 0) worker->sent += n;
+		else if (n < 0 && errno == EINTR) continue;
+		else
+		{
+			if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) worker->dead = true;
+			return;
+		}
+	}
+	worker->out.clear();
+	worker->sent = 0;
+}
+void Dispatcher::loop()
+{
+	std::vector<struct pollfd> fds;
+	std::deque<Item> fresh;
+	while (true)
+	{
+		fds.clear();
+		fds.push_back({wake[0], POLLIN, 0});
+		fds.push_back({listener, POLLIN, 0});
+		for (auto& worker:workers)
+		{
+			fds.push_back({worker->fd, (short)(POLLIN | (worker->out.empty() ? 0 : POLLOUT)), 0});
+		}
+		if (poll(fds.data(), fds.size(), 1000) < 0 && errno != EINTR) break;
+
+		char drain[256];
+		while (read(wake[0], drain, sizeof(drain)) > 0) {}
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			if (stopping) break;
+			fresh.swap(incoming);
+		}
+		for (auto& item:fresh)
+		{
+			item.seq = next_seq++;
+			route(std::move(item));
+		}
+		fresh.clear();
+
+		if (fds[1].revents & POLLIN)
+		{
+			int fd;
+			while ((fd = accept(listener, nullptr, nullptr)) != -1)
+			{
+				int on = 1;
+				setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+				fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+				workers.emplace_back(new Worker{fd, "", false, false, "", "", 0, {}, {}});
+			}
+		}
+		for (size_t i = 2; i < fds.size(); i++)
+		{
+			Worker *worker = nullptr;
+			for (auto& w:workers) if (w->fd == fds[i].fd) worker = w.get();
+			if (!worker) continue;
+			if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) receive(worker);
+		}
+
+		std::vector<Worker*> gone;
+		for (auto& worker:workers)
+		{
+			if (worker->dead) gone.push_back(worker.get());
+		}
+		for (Worker *worker:gone) remove(worker);
+
+		for (auto& worker:workers)
+		{
+			if (!worker->joined) continue;
+			fill(worker.get());
+			if (!worker->out.empty()) transmit(worker.get());
+		}
+
+		std::lock_guard<std::mutex> lock(mtx);
+		current.workers = 0;
+		current.inflight = 0;
+		for (auto& worker:workers)
+		{
+			current.workers += worker->joined;
+			current.inflight += worker->inflight.size();
+		}
+	}
+}
+
+/* Worker side of the ingest/dispatch split, runs the handler for updates that the dispatcher sends.
+Updates of a chat always go to the same lane (thread), so they are handled one by one and in order */
+class ClusterWorker
+{
+public:
+	ClusterWorker(const std::string &address, const std::string &name, unsigned int lanes, const std::function<void(Update)> &handler, unsigned int drain_timeout = 10);
+	~ClusterWorker();
+	/* Handles updates until the connection is lost or 'stop' is set, returns false if it can't connect */
+	bool serve(const std::atomic<bool> &stop);
+private:
+	struct Job
+	{
+		unsigned long long seq;
+		Update update;
+		std::chrono::steady_clock::time_point received;
+	};
+	struct Lane
+	{
+		std::deque<Job> queue;
+		bool busy = false;	// handling an update or acknowledging
+		std::mutex mtx;
+		std::condition_variable ready;
+		std::thread thread;
+	};
+
+	void run(Lane &lane);
+	void acknowledge(const std::vector<unsigned long long> &seqs);
+	void clear();
+	void drain(std::chrono::steady_clock::time_point deadline);
+
+	std::string address;
+	std::string name;
+	std::function<void(Update)> handler;
+	unsigned int drain_timeout;
+	std::vector<std::unique_ptr<Lane>> lanes;
+	std::atomic<bool> stopping;
+	int fd;
+	std::mutex write_mtx;
+};
+
+ClusterWorker::ClusterWorker(const std::string &address, const std::string &name, unsigned int lanes, const std::function<void(Update)> &handler, unsigned int drain_timeout):address(address), name(name), handler(handler), drain_timeout(drain_timeout), stopping(false), fd(-1)
+{
+	for (unsigned int i = 0; i < std::max(1u, lanes); i++)
+	{
+		this->lanes.emplace_back(new Lane());
+		this->lanes.back()->thread = std::thread(&ClusterWorker::run, this, std::ref(*this->lanes.back()));
+	}
+}
+ClusterWorker::~ClusterWorker()
+{
+	stopping = true;
+	for (auto& lane:lanes)
+	{
+		{
+			std::lock_guard<std::mutex> lock(lane->mtx);
+		}
+		lane->ready.notify_all();
+		lane->thread.join();
+	}
+}
+void ClusterWorker::run(Lane &lane)
+{
+	std::vector<unsigned long long> done;
+	while (true)
+	{
+		Job job;
+		{
+			std::unique_lock<std::mutex> lock(lane.mtx);
+			if (lane.queue.empty() && !done.empty())
+			{
+				/* The lane is idle, report everything it has handled since the last ack in one frame */
+				lock.unlock();
+				acknowledge(done);
+				done.clear();
+				lock.lock();
+			}
+			if (lane.queue.empty())
+			{
+				lane.busy = false;
+				lane.ready.notify_all();
+			}
+			lane.ready.wait(lock, [&]() { return !lane.queue.empty() || stopping; });
+			if (stopping) return;
+			job = std::move(lane.queue.front());
+			lane.queue.pop_front();
+			lane.busy = true;
+		}
+		try
+		{
+			TraceScope scope(job.update.update_id());
+			if (Tracer::context()) Tracer::instance().record("queued", Tracer::context(), job.received, std::chrono::steady_clock::now());
+			TraceSpan span("Instructions");
+			handler(std::move(job.update));
+		}
+		catch (const std::exception &e)
+		{
+			std::cerr << "\t| Error! Update handler failed: " << e.what() << std::endl;
+		}
+		done.push_back(job.seq);
+		if (done.size() >= 64)
+		{
+			acknowledge(done);
+			done.clear();
+		}
+	}
+}
+void ClusterWorker::acknowledge(const std::vector<unsigned long long> &seqs)
+{
+	std::string frame;
+	size_t start = cluster::beginFrame(frame, cluster::Ack);
+	for (unsigned long long seq:seqs) cluster::put64(frame, seq);
+	cluster::endFrame(frame, start);
+	std::lock_guard<std::mutex> lock(write_mtx);
+	if (fd != -1) cluster::sendAll(fd, frame.data(), frame.size());
+}
+void ClusterWorker::drain(std::chrono::steady_clock::time_point deadline)
+{
+	/* Whatever is still left after the deadline goes to other workers when the connection is closed */
+	for (auto& lane:lanes)
+	{
+		std::unique_lock<std::mutex> lock(lane->mtx);
+		lane->ready.wait_until(lock, deadline, [&lane]() { return lane->queue.empty() && !lane->busy; });
+	}
+}
+void ClusterWorker::clear()
+{
+	/* The dispatcher sends updates of a lost connection to other workers, don't handle them here too */
+	for (auto& lane:lanes)
+	{
+		std::lock_guard<std::mutex> lock(lane->mtx);
+		lane->queue.clear();
+	}
+}
+bool ClusterWorker::serve(const std::atomic<bool> &stop)
+{
+	int socket = cluster::open(address, false);
+	if (socket == -1) return false;
+	struct timeval wait = {0, 200000};
+	setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &wait, sizeof(wait));
+	std::string hello;
+	size_t start = cluster::beginFrame(hello, cluster::Hello);
+	hello += name;
+	cluster::endFrame(hello, start);
+	{
+		std::lock_guard<std::mutex> lock(write_mtx);
+		fd = socket;
+		if (!cluster::sendAll(fd, hello.data(), hello.size()))
+		{
+			close(fd);
+			fd = -1;
+			return true;
+		}
+	}
+	std::cout << "\tConnected to " << address << " as " << name << "." << std::endl;
+
+	std::string in;
+	char buffer[65536];
+	while (true)
+	{
+		ssize_t n = recv(socket, buffer, sizeof(buffer), 0);
+		if (stop) break;
+		if (n < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) continue;
+		if (n <= 0) break;
+		in.append(buffer, n);
+		std::chrono::steady_clock::time_point received = std::chrono::steady_clock::now();
+
+		size_t pos = 0;
+		long long size;
+		while ((size = cluster::frameSize(in, pos)) > 0)
+		{
+			const char *frame = in.data() + pos + 5;
+			size_t length = size - 5;
+			if (in[pos + 4] == cluster::Batch)
+			{
+				for (size_t i = 0; i + 12 <= length;)
+				{
+					unsigned long long seq = cluster::get64(frame + i);
+					size_t update_size = cluster::get32(frame + i + 8);
+					i += 12;
+					if (i + update_size > length) break;
+					std::shared_ptr<nlohmann::json> root = std::make_shared<nlohmann::json>(nlohmann::json::parse(frame + i, frame + i + update_size, nullptr, false));
+					i += update_size;
+					Update update(root, root.get());
+					long long key = update.message().empty() ? update.from().id() : update.chat_id();
+					Lane &lane = *lanes[cluster::hash((unsigned long long)key) % lanes.size()];
+					{
+						std::lock_guard<std::mutex> lock(lane.mtx);
+						lane.queue.push_back(Job{seq, std::move(update), received});
+					}
+					lane.ready.notify_one();
+				}
+			}
+			pos += size;
+		}
+		in.erase(0, pos);
+		if (size < 0) break;
+	}
+
+	if (stop)
+	{
+		/* Stop reading, finish what has been received and acknowledge it */
+		std::cout << "\tFinishing the updates in progress..." << std::endl;
+		drain(std::chrono::steady_clock::now() + std::chrono::seconds(drain_timeout));
+	}
+	{
+		std::lock_guard<std::mutex> lock(write_mtx);
+		close(fd);
+		fd = -1;
+	}
+	clear();
+	if (!stop) std::cerr << "\t| Error! Lost connection to " << address << "." << std::endl;
+	return true;
+}
+
+/* Where the elements of the "result" array of a getUpdates response are in the text, as [begin, end) pairs.
+Only objects are expected there, so scalars between them are skipped. Returns false if the array isn't found */
+static bool resultSpans(const std::string &text, std::vector<std::pair<size_t, size_t> > &spans)
+{
+	spans.clear();
+	int depth = 0;
+	bool key = false, inside = false;
+	size_t begin = 0;
+	for (size_t i = 0; i < text.size(); i++)
+	{
+		char c = text[i];
+		if (c == '"')
+		{
+			size_t start = i + 1;
+			for (i++; i < text.size() && text[i] != '"'; i++)
+			{
+				if (text[i] == '\\') i++;
+			}
+			if (depth == 1) key = text.compare(start, i - start, "result") == 0;
+		}
+		else if (c == '{' || c == '[')
+		{
+			if (depth == 1 && c == '[' && key) inside = true;
+			else if (depth == 2 && inside) begin = i;
+			depth++;
+		}
+		else if (c == '}' || c == ']')
+		{
+			depth--;
+			if (depth == 2 && inside) spans.push_back(std::make_pair(begin, i + 1));
+			else if (depth == 1 && inside) return true;
+		}
+	}
+	return false;
+}
+
+/* Binary log of received updates for offline replay.
+The file starts with "TGREC1\n" and a zero byte, followed by records [delay][length][update JSON], where the delay is the time
+since the previous record in microseconds and both numbers are varints. Updates received in one batch have zero delay */
+class UpdateLog
+{
+public:
+	UpdateLog():file(nullptr), started(false) {}
+	~UpdateLog()
+	{
+		if (file) fclose(file);
+	}
+	/* Starts a new log, an existing file is overwritten */
+	bool create(const std::string &path)
+	{
+		file = fopen(path.c_str(), "wb");
+		return file && fwrite(magic(), 1, 8, file) == 8;
+	}
+	bool open(const std::string &path)
+	{
+		char header[8];
+		file = fopen(path.c_str(), "rb");
+		return file && fread(header, 1, 8, file) == 8 && memcmp(header, magic(), 8) == 0;
+	}
+	void write(const char *update, size_t size, std::chrono::steady_clock::time_point time)
+	{
+		unsigned long long delay = started ? std::chrono::duration_cast<std::chrono::microseconds>(time - last).count() : 0;
+		started = true;
+		last = time;
+		putVarint(delay);
+		putVarint(size);
+		fwrite(update, 1, size, file);
+	}
+	void flush()
+	{
+		fflush(file);
+	}
+	/* Returns false at the end of the log or at a torn record */
+	bool read(unsigned long long &delay, std::string &update)
+	{
+		unsigned long long size;
+		if (!getVarint(delay) || !getVarint(size) || size > (64 << 20)) return false;
+		update.resize(size);
+		return fread(&update[0], 1, size, file) == size;
+	}
+private:
+	static const char *magic() { return "TGREC1\n"; }
+
+	void putVarint(unsigned long long value)
+	{
+		unsigned char bytes[10];
+		int n = 0;
+		do
+		{
+			bytes[n++] = (value & 0x7F) | (value > 0x7F ? 0x80 : 0);
+			value >>= 7;
+		}
+		while (value);
+		fwrite(bytes, 1, n, file);
+	}
+	bool getVarint(unsigned long long &value)
+	{
+		value = 0;
+		for (int shift = 0; shift < 64; shift += 7)
+		{
+			int c = fgetc(file);
+			if (c == EOF) return false;
+			value |= (unsigned long long)(c & 0x7F) << shift;
+			if (!(c & 0x80)) return true;
+		}
+		return false;
+	}
+
+	FILE *file;
+	bool started;
+	std::chrono::steady_clock::time_point last;
 };
 
-struct content
+/* Fake Bot API on a unix socket, used instead of Telegram while replaying.
+Every method succeeds after the given latency, files are downloaded as a few bytes, and the number of calls is counted */
+class ApiStub
 {
-	std::string photo;
-	std::string video;
-	std::string document;
-	std::string text;
-	std::string audio;
-	std::string sticker;
-	ReplyKeyboardMarkup reply_keyboard;
-	ReplyKeyboardHide hide_reply_keyboard;
+public:
+	ApiStub(const std::string &path, unsigned int latency);
+	~ApiStub();
+	bool start();
+	const std::string &path() const { return socket_path; }
+	std::map<std::string, unsigned long long> calls();
+private:
+	void accept();
+	void serve(int fd);
+	std::string respond(const std::string &target);
+
+	std::string socket_path;
+	unsigned int latency;
+	int listener;
+	std::atomic<bool> stopping;
+	std::thread acceptor;
+	std::vector<std::thread> connections;
+	std::vector<int> fds;
+	std::map<std::string, unsigned long long> counts;
+	unsigned long long next_id;
+	std::mutex mtx;
 };
 
-static size_t curlWriter(char *data, size_t size, size_t nmemb, std::string *buffer)
+ApiStub::ApiStub(const std::string &path, unsigned int latency):socket_path(path), latency(latency), listener(-1), stopping(false), next_id(1)
 {
-	size_t result = size * nmemb;
-	buffer->append(data, result);
-	return result;
 }
-
-static size_t curlFileWriter(char *data, size_t size, size_t nmemb, std::ofstream *file)
+ApiStub::~ApiStub()
 {
-	size_t result = size * nmemb;
-	file->write(data, result);
-	return result;
+	stopping = true;
+	if (listener != -1) shutdown(listener, SHUT_RDWR);
+	if (acceptor.joinable()) acceptor.join();
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		for (int fd:fds) shutdown(fd, SHUT_RDWR);
+	}
+	for (auto& connection:connections) connection.join();
+	for (int fd:fds) close(fd);
+	if (listener != -1)
+	{
+		close(listener);
+		unlink(socket_path.c_str());
+	}
+}
+bool ApiStub::start()
+{
+	listener = cluster::open("unix:" + socket_path, true);
+	if (listener == -1) return false;
+	acceptor = std::thread(&ApiStub::accept, this);
+	return true;
+}
+std::map<std::string, unsigned long long> ApiStub::calls()
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	return counts;
+}
+void ApiStub::accept()
+{
+	while (!stopping)
+	{
+		int fd = ::accept(listener, nullptr, nullptr);
+		if (fd == -1)
+		{
+			if (errno == EINTR) continue;
+			break;
+		}
+		std::lock_guard<std::mutex> lock(mtx);
+		fds.push_back(fd);
+		connections.emplace_back(&ApiStub::serve, this, fd);
+	}
+}
+std::string ApiStub::respond(const std::string &target)
+{
+	std::string method = target.substr(target.rfind('/') + 1);
+	bool file = target.find("/file/bot") != std::string::npos;
+	unsigned long long id;
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		counts[file ? "file" : method]++;
+		id = next_id++;
+	}
+	if (file) return "stub";
+	if (method == "getFile")
+	{
+		return "{\"ok\":true,\"result\":{\"file_id\":\"stub\",\"file_size\":4,\"file_path\":\"stub/file_" + std::to_string(id) + "\"}}";
+	}
+	return "{\"ok\":true,\"result\":{\"message_id\":" + std::to_string(id) + ",\"date\":0,\"chat\":{\"id\":0,\"type\":\"private\"}}}";
+}
+void ApiStub::serve(int fd)
+{
+	std::string in;
+	char buffer[65536];
+	while (!stopping)
+	{
+		/* Headers, then as much body as Content-Length says */
+		size_t end;
+		while ((end = in.find("\r\n\r\n")) == std::string::npos)
+		{
+			ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+			if (n <= 0) return;
+			in.append(buffer, n);
+		}
+		std::string headers = in.substr(0, end);
+		for (char &c:headers) c = tolower(c);
+		size_t length = 0;
+		size_t field = headers.find("\r\ncontent-length:");
+		if (field != std::string::npos) length = strtoull(headers.c_str() + field + 17, nullptr, 10);
+		if (headers.find("\r\nexpect: 100-continue") != std::string::npos)
+		{
+			static const char proceed[] = "HTTP/1.1 100 Continue\r\n\r\n";
+			if (!cluster::sendAll(fd, proceed, sizeof(proceed) - 1)) return;
+		}
+		while (in.size() < end + 4 + length)
+		{
+			ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+			if (n <= 0) return;
+			in.append(buffer, n);
+		}
+		size_t target_start = in.find(' ') + 1;
+		std::string target = in.substr(target_start, in.find(' ', target_start) - target_start);
+		in.erase(0, end + 4 + length);
+
+		if (latency > 0) std::this_thread::sleep_for(std::chrono::milliseconds(latency));
+		std::string body = respond(target);
+		std::string response = "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nContent-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body;
+		if (!cluster::sendAll(fd, response.data(), response.size())) return;
+	}
 }
 
+/* Result of a replay */
+struct ReplayReport
+{
+	unsigned long long updates;
+	double seconds;
+	double max_lag;		// how far the replay fell behind the recorded timing (milliseconds)
+	std::map<std::string, unsigned long long> calls;	// Bot API calls made by the handlers
+};
+
+/* Number of chats a broadcast has reached */
+struct BroadcastReport
+{
+	unsigned long long delivered;
+	unsigned long long failed;
+	unsigned long long blocked;	// the bot was blocked by the user or the chat no longer exists
+};
+
+class Telegrab;
+
+/* Text message that a handler writes bit by bit (progress, a long generated answer), see Telegrab::stream().
+The text is shown by editing the message at most once per "stream" interval, and continues in a new message
+when it doesn't fit into one. A stream must be closed or destroyed before the bot */
+class MessageStream
+{
+public:
+	MessageStream(MessageStream &&other):bot(other.bot), state(std::move(other.state)) {}
+	~MessageStream();
+	MessageStream &operator<<(const std::string &text);
+	void append(const std::string &text);
+	/* Sends the rest of the text and waits until it's shown */
+	void close();
+	/* Messages the text has been split into */
+	std::vector<unsigned int> messages();
+private:
+	friend class Telegrab;
+	struct State
+	{
+		long long chat_id;
+		unsigned int reply_to_message_id;
+		Priority priority;
+		std::string text;	// everything appended so far
+		size_t start;	// where the last message begins in the text
+		std::string shown;	// text of the last message as Telegram has it
+		unsigned int message_id;	// last message, 0 - not sent yet
+		std::vector<unsigned int> messages;
+		std::chrono::steady_clock::time_point next;	// no requests before this
+		bool scheduled;
+		bool flushing;
+		bool closed;
+		bool failed;
+		std::mutex mtx;
+		std::condition_variable flushed;
+	};
+	MessageStream(Telegrab *bot, const std::shared_ptr<State> &state):bot(bot), state(state) {}
+	MessageStream(const MessageStream&) = delete;
+	MessageStream &operator=(const MessageStream&) = delete;
+
+	Telegrab *bot;
+	std::shared_ptr<State> state;
+};
+
 class Telegrab
 {
 public:
 	Telegrab(std::string token);
 	~Telegrab();
-	void send(content message, unsigned int chat_id, unsigned int reply_to_message_id = 0);
-	void forward(unsigned int message_id, unsigned int chat_id_from, unsigned int chat_id_to);
+	void send(content message, long long chat_id, unsigned int reply_to_message_id = 0, Priority priority = Priority::Normal);
+	bool enqueue(content message, long long chat_id, unsigned int reply_to_message_id = 0, Priority priority = Priority::Normal);
+	void forward(unsigned int message_id, long long chat_id_from, long long chat_id_to, Priority priority = Priority::Normal);
+	void answerCallbackQuery(std::string callback_query_id, std::string text = "", bool show_alert = false);
+	void editMessageText(long long chat_id, unsigned int message_id, std::string text, Priority priority = Priority::Normal);
+	MessageStream stream(long long chat_id, unsigned int reply_to_message_id = 0, Priority priority = Priority::Normal);
 	void start();
+	void stop();
+	/* True once the shutdown deadline has passed: handlers that take long should check it and return */
+	bool cancelled() const;
 	std::string download(std::string given);
+	LatencyStats latency(Priority priority);
+	StartupStats startup();
+	SessionStore &sessions();
+	HttpClient &http();
+	PollingStats pollingStats();
+	ClusterStats clusterStats();
+	bool exportTrace(std::string path);
+	ReplayReport replay(std::string path, double speed = 1);
+	BroadcastReport broadcast(content message, std::function<bool(long long&)> chat_id_source, std::string checkpoint = "");
+	BroadcastReport broadcast(content message, std::istream &chat_ids, std::string checkpoint = "");
 private:
 	unsigned int limit;
 	unsigned int interval;
@@ -119,30 +3329,139 @@ private:
 	unsigned int retryTimeout;
 	unsigned int last_update_id;
 	unsigned int last_file_id;
+	unsigned int broadcastRate;
+	unsigned int broadcastSenders;
 	std::string bot_token;
 
-	void Instructions(incoming data);
-	void sendFile(std::string name, std::string text, unsigned int chat_id, unsigned char type, bool &caption, bool &rkeyboard, unsigned int reply_to_message_id, ReplyKeyboardMarkup reply_keyboard, ReplyKeyboardHide hide_reply_keyboard);
+	/* Response to a single request, collected by the senders that need more than a log line */
+	struct SendResult
+	{
+		unsigned char type;
+		CURLcode code;
+		long http_code;
+		std::string response;
+	};
+
+	/* Message of the persistent outbound queue */
+	struct QueuedMessage
+	{
+		unsigned long long id;
+		content message;
+		long long chat_id;
+		unsigned int reply_to_message_id;
+		Priority priority;
+		unsigned int attempt;
+	};
+
+	void Instructions(Update data);
+	void queueWorker();
+	void schedule(QueuedMessage item, std::chrono::steady_clock::time_point due);
+	void deliver(const content &message, long long chat_id, unsigned int reply_to_message_id, Priority priority, std::vector<SendResult> *results);
+	void sendFile(const std::string &name, const std::string &text, long long chat_id, unsigned char type, bool &caption, bool &rkeyboard, unsigned int reply_to_message_id, const ReplyKeyboardMarkup &reply_keyboard, const ReplyKeyboardHide &hide_reply_keyboard, Priority priority, std::vector<SendResult> *results);
+	void editText(long long chat_id, unsigned int message_id, const std::string &text, Priority priority, std::vector<SendResult> *results);
+	void sendMediaGroup(const std::vector<Attachment> &attachments, size_t begin, size_t end, const std::string &text, long long chat_id, bool &caption, unsigned int reply_to_message_id, Priority priority, std::vector<SendResult> *results);
 	bool waitForUpdates();
+	void handleUpdates(const std::shared_ptr<nlohmann::json> &file, const nlohmann::json &result, std::chrono::steady_clock::time_point poll_start, std::chrono::steady_clock::time_point received, std::chrono::steady_clock::time_point parsed);
 
 	bool fatalError;
 
 	CURL* CurlInit();
+	bool perform(Priority priority, const std::function<void(CURL*)> &job);
+	RequestBody &requestBody();
+	void setBody(CURL *curl, RequestBody &body);
+	const char *apiUrl(const char *method);
+	const std::string &server() const;
+
+	bool jsonRequests;
+	struct curl_slist *jsonHeaders;
+
+	std::unique_ptr<Wal> wal;
+	std::multimap<std::chrono::steady_clock::time_point, QueuedMessage> queued;
+	std::vector<std::thread> queueWorkers;
+	std::mutex queueMtx;
+	std::condition_variable queueReady;
+	bool queueStopping;
+	unsigned int queueMaxBackoff;
+
+	friend class MessageStream;
+	std::multimap<std::chrono::steady_clock::time_point, std::shared_ptr<MessageStream::State>> streams;
+	std::vector<std::thread> streamWorkers;
+	std::mutex streamMtx;
+	std::condition_variable streamReady;
+	bool streamStopping;
+	unsigned int streamInterval;
+	unsigned int streamSenders;
+	void streamWorker();
+	void scheduleStream(const std::shared_ptr<MessageStream::State> &state, std::chrono::steady_clock::time_point due);
+	void flushStream(const std::shared_ptr<MessageStream::State> &state, bool final);
+
+	std::string apiServer;
+	std::unique_ptr<PollController> poller;
+	std::atomic<unsigned int> handlersRunning;
+
+	std::string clusterRole;
+	std::string clusterAddress;
+	std::string clusterName;
+	unsigned int clusterLanes;
+	std::unique_ptr<Dispatcher> dispatcher;
+	void work();
+
+	std::atomic<bool> stopRequested;
+	unsigned int drainTimeout;
+	unsigned int drainGrace;
+	std::string stateFile;
+	std::string handoffAddress;
+	std::atomic<int> handoffListener;
+	std::atomic<int> successor;
+	std::thread handoffThread;
+	std::thread takeoverThread;
+	/* Handler threads are joined, so none of them outlives the bot. A thread adds its number to handlersDone when it returns */
+	std::mutex inflightMtx;
+	std::map<unsigned int, Update> inflight;
+	std::set<unsigned int> handling;	// updates whose handlers have started and not returned yet
+	std::map<unsigned long long, std::thread> handlerThreads;
+	std::vector<unsigned long long> handlersDone;
+	unsigned long long handlersStarted;
+	std::atomic<bool> handlersCancelled;
+	void joinHandlers(bool all);
+	void restore();
+	void resume(const std::vector<std::string> &updates);
+	void drain();
+	void commitOffset(unsigned int last);
+	bool pause(std::chrono::milliseconds delay);
+	static int abortOnStop(void *bot, curl_off_t, curl_off_t, curl_off_t, curl_off_t);
+
+	std::unique_ptr<UpdateLog> recorder;
+	std::unique_ptr<ApiStub> stub;
+	unsigned int stubLatency;
+	std::atomic<bool> replaying;	// requests go to the stub, apiServer itself never changes after the constructor
+
+	std::unique_ptr<SessionStore> sessionStore;
+	std::string sessionSnapshot;
+	unsigned int sessionSnapshotInterval;
+	std::chrono::steady_clock::time_point lastSnapshot;
+	void saveSessions(bool force);
+
+	std::chrono::steady_clock::time_point created;
+	double constructed;
 
 	std::mutex mtx;
+	std::unique_ptr<Outbound> outbound;
+	std::unique_ptr<HttpClient> httpClient;
 };
 
-Telegrab::Telegrab(std::string str):fatalError(false), last_update_id(0), last_file_id(0)
+Telegrab::Telegrab(std::string str):fatalError(false), last_update_id(0), last_file_id(0), broadcastRate(30), broadcastSenders(4), jsonRequests(false), jsonHeaders(nullptr), queueStopping(false), queueMaxBackoff(300), streamStopping(false), streamInterval(1000), streamSenders(2), apiServer("https://api.telegram.org"), handlersRunning(0), clusterRole("standalone"), clusterLanes(8), stopRequested(false), drainTimeout(10), drainGrace(5), handoffListener(-1), successor(-1), handlersStarted(0), handlersCancelled(false), stubLatency(0), replaying(false), sessionStore(new SessionStore()), sessionSnapshotInterval(300), created(std::chrono::steady_clock::now()), constructed(0), httpClient(new HttpClient(8, 4, 60, 1024, 10))
 {
 	try
 	{
 		/* Open or create config file */
+		nlohmann::json config;
 		if (str.find(".json") != std::string::npos)
 		{
 			std::ifstream file(str);
 			if (file.is_open())
 			{
-				nlohmann::json config = nlohmann::json::parse(file);
+				config = nlohmann::json::parse(file);
 				limit = config["polling"]["limit"];
 				interval = config["polling"]["interval"];
 				timeout = config["polling"]["timeout"];
@@ -162,7 +3481,7 @@ Telegrab::Telegrab(std::string str):fatalError(false), last_update_id(0), last_f
 			std::ifstream file(str + ".json");
 			if (file.is_open())
 			{
-				nlohmann::json config = nlohmann::json::parse(file);
+				config = nlohmann::json::parse(file);
 				limit = config["polling"]["limit"];
 				interval = config["polling"]["interval"];
 				timeout = config["polling"]["timeout"];
@@ -174,13 +3493,53 @@ Telegrab::Telegrab(std::string str):fatalError(false), last_update_id(0), last_f
 				std::ofstream file(str + ".json", std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
 				if (file.is_open())
 				{
-					nlohmann::json temp;
-					temp["token"] = str;
-					temp["polling"]["limit"] = 100; limit = 100;
-					temp["polling"]["interval"] = 0; interval = 0;
-					temp["polling"]["timeout"] = 30; timeout = 30;
-					temp["polling"]["retryTimeout"] = 10; retryTimeout = 10;
-					file << temp;
+					config["token"] = str;
+					config["polling"]["limit"] = 100; limit = 100;
+					config["polling"]["interval"] = 0; interval = 0;
+					config["polling"]["timeout"] = 30; timeout = 30;
+					config["polling"]["retryTimeout"] = 10; retryTimeout = 10;
+					config["polling"]["adaptive"] = true;
+					config["polling"]["maxBacklog"] = 64;
+					config["polling"]["breakerThreshold"] = 5;
+					config["outbound"]["connections"] = 8;
+					config["outbound"]["json"] = false;
+					config["outbound"]["normal"] = 5;
+					config["outbound"]["bulk"] = 2;
+					config["outbound"]["slo"]["interactive"] = 1000;
+					config["outbound"]["slo"]["normal"] = 3000;
+					config["outbound"]["slo"]["bulk"] = 0;
+					config["outbound"]["warm"] = 2;
+					config["outbound"]["tlsCache"] = "";
+					config["broadcast"]["rate"] = 30;
+					config["broadcast"]["senders"] = 4;
+					config["stream"]["interval"] = 1000;
+					config["stream"]["senders"] = 2;
+					config["queue"]["enabled"] = false;
+					config["queue"]["path"] = "queue";
+					config["queue"]["segmentSize"] = 4194304;
+					config["queue"]["groupCommit"] = 2;
+					config["queue"]["senders"] = 2;
+					config["queue"]["maxBackoff"] = 300;
+					config["sessions"]["ttl"] = 86400;
+					config["sessions"]["capacity"] = 0;
+					config["sessions"]["snapshot"] = "";
+					config["sessions"]["snapshotInterval"] = 300;
+					config["cluster"]["role"] = "standalone";
+					config["cluster"]["address"] = "unix:telegrab.sock";
+					config["tracing"]["sampleRate"] = 0;
+					config["tracing"]["buffer"] = 4096;
+					config["replay"]["record"] = "";
+					config["replay"]["stubLatency"] = 0;
+					config["http"]["connections"] = 8;
+					config["http"]["perHost"] = 4;
+					config["http"]["ttl"] = 60;
+					config["http"]["cacheSize"] = 1024;
+					config["http"]["timeout"] = 10;
+					config["shutdown"]["deadline"] = 10;
+					config["shutdown"]["grace"] = 5;
+					config["shutdown"]["state"] = "";
+					config["shutdown"]["handoff"] = "";
+					file << config;
 					file.close();
 				}
 				else
@@ -225,6 +3584,127 @@ Telegrab::Telegrab(std::string str):fatalError(false), last_update_id(0), last_f
 		}
 
 		curl_global_init(CURL_GLOBAL_DEFAULT);
+
+		/* Outbound connections: interactive requests may use all of them, other classes are limited by their budgets and leave one to them.
+		The first 'warm' of them connect while the rest of the config is loaded */
+		apiServer = config.value("api", apiServer);
+		nlohmann::json outbound_config = config.value("outbound", nlohmann::json::object());
+		nlohmann::json slo_config = outbound_config.value("slo", nlohmann::json::object());
+		unsigned int connections = outbound_config.value("connections", 8);
+		Warmup warmup = {apiServer + "/", outbound_config.value("warm", 2u), outbound_config.value("tlsCache", "")};
+		outbound.reset(new Outbound(connections,
+			{{connections, outbound_config.value("normal", 5u), outbound_config.value("bulk", 2u)}},
+			{{slo_config.value("interactive", 1000u), slo_config.value("normal", 3000u), slo_config.value("bulk", 0u)}}, warmup));
+
+		/* Client for the requests that handlers make to other services */
+		nlohmann::json http_config = config.value("http", nlohmann::json::object());
+		httpClient.reset(new HttpClient(http_config.value("connections", 8u), http_config.value("perHost", 4u), http_config.value("ttl", 60u),
+			http_config.value("cacheSize", 1024u), http_config.value("timeout", 10u)));
+
+		jsonRequests = outbound_config.value("json", false);
+		jsonHeaders = curl_slist_append(jsonHeaders, "Content-Type: application/json");
+
+		nlohmann::json broadcast_config = config.value("broadcast", nlohmann::json::object());
+		broadcastRate = broadcast_config.value("rate", 30u);
+		broadcastSenders = broadcast_config.value("senders", 4u);
+
+		nlohmann::json stream_config = config.value("stream", nlohmann::json::object());
+		streamInterval = stream_config.value("interval", 1000u);
+		streamSenders = std::max(stream_config.value("senders", 2u), 1u);
+
+		nlohmann::json polling_config = config.value("polling", nlohmann::json::object());
+		poller.reset(new PollController(polling_config.value("adaptive", true), limit, interval, retryTimeout,
+			polling_config.value("maxBacklog", 64u), polling_config.value("breakerThreshold", 5u)));
+
+		nlohmann::json sessions_config = config.value("sessions", nlohmann::json::object());
+		sessionStore.reset(new SessionStore(sessions_config.value("ttl", 86400u), sessions_config.value("capacity", 0u)));
+		sessionSnapshot = sessions_config.value("snapshot", "");
+		sessionSnapshotInterval = sessions_config.value("snapshotInterval", 300u);
+		lastSnapshot = std::chrono::steady_clock::now();
+		if (!sessionSnapshot.empty() && sessionStore->load(sessionSnapshot))
+		{
+			std::cout << "\t" << sessionStore->size() << " sessions restored from " << sessionSnapshot << "." << std::endl;
+		}
+
+		nlohmann::json tracing_config = config.value("tracing", nlohmann::json::object());
+		Tracer::instance().configure(tracing_config.value("sampleRate", 0.0), tracing_config.value("buffer", 4096u));
+
+		nlohmann::json shutdown_config = config.value("shutdown", nlohmann::json::object());
+		drainTimeout = shutdown_config.value("deadline", 10u);
+		drainGrace = shutdown_config.value("grace", 5u);
+		stateFile = shutdown_config.value("state", "");
+		handoffAddress = shutdown_config.value("handoff", "");
+
+		/* Received updates are written to a log that replay() can feed back later */
+		nlohmann::json replay_config = config.value("replay", nlohmann::json::object());
+		stubLatency = replay_config.value("stubLatency", 0u);
+		std::string record_path = replay_config.value("record", "");
+		if (!record_path.empty())
+		{
+			recorder.reset(new UpdateLog());
+			if (!recorder->create(record_path))
+			{
+				std::cerr << "\t| Error! Can't create " << record_path << "." << std::endl;
+				throw 1;
+			}
+		}
+
+		/* Dispatcher polls Telegram and forwards updates to the workers, workers handle them */
+		nlohmann::json cluster_config = config.value("cluster", nlohmann::json::object());
+		clusterRole = cluster_config.value("role", clusterRole);
+		clusterAddress = cluster_config.value("address", "unix:telegrab.sock");
+		clusterLanes = cluster_config.value("lanes", 8u);
+		char host[256] = {0};
+		gethostname(host, sizeof(host) - 1);
+		clusterName = cluster_config.value("name", std::string(host) + "-" + std::to_string(getpid()));
+		if (clusterRole == "dispatcher")
+		{
+			dispatcher.reset(new Dispatcher(clusterAddress, cluster_config.value("batch", 64u), cluster_config.value("window", 256u), cluster_config.value("maxPending", 4096u)));
+			if (!dispatcher->listen()) throw 1;
+		}
+		else if (clusterRole != "worker" && clusterRole != "standalone")
+		{
+			std::cerr << "\t| Error! Unknown cluster role '" << clusterRole << "'." << std::endl;
+			throw 1;
+		}
+
+		/* Persistent outbound queue, messages left from the previous run are sent again */
+		nlohmann::json queue_config = config.value("queue", nlohmann::json::object());
+		if (queue_config.value("enabled", false))
+		{
+			std::string queue_path = queue_config.value("path", "queue");
+			queueMaxBackoff = queue_config.value("maxBackoff", 300u);
+			if (chmod(queue_path.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) == -1 && mkdir(queue_path.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) == -1)
+			{
+				std::cerr << "\t| Error! Unable to create '" << queue_path << "' folder." << std::endl;
+				throw 1;
+			}
+			wal.reset(new Wal(queue_path, queue_config.value("segmentSize", 4194304u), queue_config.value("groupCommit", 2u)));
+			unsigned long long replayed = 0;
+			bool opened = wal->open([this, &replayed](unsigned long long id, const std::string &payload)
+			{
+				nlohmann::json record = nlohmann::json::parse(payload, nullptr, false);
+				if (!record.is_object()) return;
+				QueuedMessage item = {id, record.value("message", nlohmann::json::object()).get<content>(), record.value("chat_id", 0ll),
+					record.value("reply_to_message_id", 0u), static_cast<Priority>(record.value("priority", 1)), 0};
+				schedule(item, std::chrono::steady_clock::now());
+				replayed++;
+			});
+			if (!opened)
+			{
+				std::cerr << "\t| Error! Unable to open the outbound queue in '" << queue_path << "'." << std::endl;
+				wal.reset();
+				throw 1;
+			}
+			if (replayed > 0)
+			{
+				std::cout << "\t" << replayed << " messages left in the outbound queue, sending them again..." << std::endl;
+			}
+			for (unsigned int i = 0; i < std::max(queue_config.value("senders", 2u), 1u); i++)
+			{
+				queueWorkers.emplace_back(&Telegrab::queueWorker, this);
+			}
+		}
 	}
 	catch (int)
 	{
@@ -234,20 +3714,217 @@ Telegrab::Telegrab(std::string str):fatalError(false), last_update_id(0), last_f
 	{
 		fatalError = true;
 	}
+	constructed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - created).count();
 }
 Telegrab::~Telegrab()
 {
+	/* The listener is closed by the handoff thread if a successor connected */
+	int listener = handoffListener.exchange(-1);
+	if (listener != -1) ::shutdown(listener, SHUT_RDWR);
+	if (handoffThread.joinable()) handoffThread.join();
+	if (takeoverThread.joinable()) takeoverThread.join();
+	if (listener != -1)
+	{
+		close(listener);
+		if (successor == -1 && handoffAddress.compare(0, 5, "unix:") == 0) unlink(handoffAddress.c_str() + 5);
+	}
+	joinHandlers(true);
+	{
+		std::lock_guard<std::mutex> lock(queueMtx);
+		queueStopping = true;
+	}
+	queueReady.notify_all();
+	for (auto& worker:queueWorkers)
+	{
+		worker.join();
+	}
+	{
+		std::lock_guard<std::mutex> lock(streamMtx);
+		streamStopping = true;
+	}
+	streamReady.notify_all();
+	for (auto& worker:streamWorkers)
+	{
+		worker.join();
+	}
+	dispatcher.reset();
+	wal.reset();
+	outbound.reset();
+	httpClient.reset();
+	stub.reset();
+	recorder.reset();
+	if (!fatalError) saveSessions(true);
+	curl_slist_free_all(jsonHeaders);
 	curl_global_cleanup();
 }
 CURL* Telegrab::CurlInit()
 {
 	CURL *curl = nullptr;
 	curl = curl_easy_init();
-	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curlWriter);
-	curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0L);
-	curl_easy_setopt(curl, CURLOPT_POST, 1);
+	if (curl) curlDefaults(curl);
+	if (curl && outbound) outbound->attach(curl);
 	return curl;
 }
+bool Telegrab::perform(Priority priority, const std::function<void(CURL*)> &job)
+{
+	if (!outbound) return false;
+	if (!replaying) return outbound->perform(priority, job);
+
+	/* Replaying, every request goes to the stub instead */
+	return outbound->perform(priority, [this, &job](CURL *curl)
+	{
+		curl_easy_setopt(curl, CURLOPT_UNIX_SOCKET_PATH, stub->path().c_str());
+		job(curl);
+	});
+}
+RequestBody &Telegrab::requestBody()
+{
+	return RequestBody::local(jsonRequests ? RequestBody::Json : RequestBody::Form);
+}
+void Telegrab::setBody(CURL *curl, RequestBody &body)
+{
+	curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, (long)body.size());
+	curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body.data());
+	if (body.type() == RequestBody::Json)
+	{
+		curl_easy_setopt(curl, CURLOPT_HTTPHEADER, jsonHeaders);
+	}
+}
+/* URL of the Bot API method, in a reused thread-local buffer */
+const char *Telegrab::apiUrl(const char *method)
+{
+	static thread_local std::string url;
+	url.assign(server());
+	url += "/bot";
+	url += bot_token;
+	url += '/';
+	url += method;
+	return url.c_str();
+}
+/* Address of the Bot API, or of the stub while replaying: the stub listens on a unix socket and speaks plain HTTP */
+const std::string &Telegrab::server() const
+{
+	static const std::string stubServer = "http://replay";
+	return replaying ? stubServer : apiServer;
+}
+bool Telegrab::exportTrace(std::string path)
+{
+	if (!Tracer::instance().exportJson(path))
+	{
+		std::cerr << "\t| Error! Can't write trace to " << path << "." << std::endl;
+		return false;
+	}
+	return true;
+}
+ReplayReport Telegrab::replay(std::string path, double speed)
+{
+	ReplayReport report = {0, 0, 0, {}};
+	if (fatalError) return report;
+	UpdateLog log;
+	if (!log.open(path))
+	{
+		std::cerr << "\t| Error! Can't open " << path << "." << std::endl;
+		return report;
+	}
+	if (!stub)
+	{
+		stub.reset(new ApiStub("telegrab-replay-" + std::to_string(getpid()) + ".sock", stubLatency));
+		if (!stub->start())
+		{
+			std::cerr << "\t| Error! Can't start the Bot API stub." << std::endl;
+			stub.reset();
+			return report;
+		}
+	}
+	replaying = true;
+	std::cout << "\tReplaying " << path << "..." << std::endl;
+
+	std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+	double schedule = 0;
+	unsigned long long delay;
+	std::string update, batch;
+	bool more = log.read(delay, update);
+	while (more)
+	{
+		/* Updates with no delay between them came in one getUpdates response */
+		size_t count = 0;
+		batch.assign("{\"ok\":true,\"result\":[");
+		do
+		{
+			if (count++ > 0) batch += ',';
+			batch += update;
+			more = log.read(delay, update);
+		}
+		while (more && delay == 0);
+		batch += "]}";
+
+		if (speed > 0)
+		{
+			std::chrono::steady_clock::time_point due = begin + std::chrono::microseconds((long long)schedule);
+			std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+			if (now < due) std::this_thread::sleep_until(due);
+			else report.max_lag = std::max(report.max_lag, std::chrono::duration<double, std::milli>(now - due).count());
+			schedule += delay / speed;
+		}
+
+		std::chrono::steady_clock::time_point received = std::chrono::steady_clock::now();
+		std::shared_ptr<nlohmann::json> file = std::make_shared<nlohmann::json>(nlohmann::json::parse(batch, nullptr, false));
+		if (file->is_discarded())
+		{
+			std::cerr << "\t| Error! Can't parse updates." << std::endl;
+			continue;
+		}
+		handleUpdates(file, (*file)["result"], received, received, std::chrono::steady_clock::now());
+		report.updates += count;
+	}
+
+	while (handlersRunning > 0 || (dispatcher && dispatcher->backlog() > 0))
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	replaying = false;
+	report.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+	report.calls = stub->calls();
+	std::cout << "\tReplayed " << report.updates << " updates in " << report.seconds << " seconds." << std::endl;
+	return report;
+}
+ClusterStats Telegrab::clusterStats()
+{
+	if (!dispatcher) return ClusterStats{0, 0, 0, 0, 0, 0};
+	return dispatcher->stats();
+}
+PollingStats Telegrab::pollingStats()
+{
+	if (!poller) return PollingStats{limit, 0, 0, 0, 0, Breaker::Closed, 0, 0};
+	return poller->stats();
+}
+SessionStore &Telegrab::sessions()
+{
+	return *sessionStore;
+}
+HttpClient &Telegrab::http()
+{
+	return *httpClient;
+}
+void Telegrab::saveSessions(bool force)
+{
+	if (sessionSnapshot.empty()) return;
+	if (!force && std::chrono::steady_clock::now() - lastSnapshot < std::chrono::seconds(sessionSnapshotInterval)) return;
+	sessionStore->expire();
+	sessionStore->save(sessionSnapshot);
+	lastSnapshot = std::chrono::steady_clock::now();
+}
+LatencyStats Telegrab::latency(Priority priority)
+{
+	if (!outbound) return LatencyStats{0, 0, 0, 0, 0};
+	return outbound->latency(priority);
+}
+StartupStats Telegrab::startup()
+{
+	StartupStats stats = outbound ? outbound->startup(created) : StartupStats{0, 0, 0, 0};
+	stats.constructed = constructed;
+	return stats;
+}
 bool Telegrab::waitForUpdates()
 {
 	CURL *curl = CurlInit();
@@ -258,200 +3935,238 @@ bool Telegrab::waitForUpdates()
 	}
 
 	std::string buffer;
-	std::string url = "https://api.telegram.org/bot" + bot_token + "/getUpdates";
-	std::string post_url = "limit=" + std::to_string(limit);
+	RequestBody &body = requestBody();
+	body.add("limit", (long long)poller->limit());
 	if (timeout > 0)
 	{
-		post_url += "&timeout=" + std::to_string(timeout);
+		body.add("timeout", (long long)timeout);
 	}
 	if (last_update_id > 0)
 	{
-		post_url += "&offset=" + std::to_string(last_update_id + 1);
+		body.add("offset", (long long)last_update_id + 1);
 	}
 
-	curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-	curl_easy_setopt(curl, CURLOPT_POSTFIELDS, post_url.c_str());
+	curl_easy_setopt(curl, CURLOPT_URL, apiUrl("getUpdates"));
+	setBody(curl, body);
 	curl_easy_setopt(curl, CURLOPT_WRITEDATA, &buffer);
+	/* stop() interrupts the long poll */
+	curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, abortOnStop);
+	curl_easy_setopt(curl, CURLOPT_XFERINFODATA, this);
+	curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+	std::chrono::steady_clock::time_point poll_start = std::chrono::steady_clock::now();
 	CURLcode res = curl_easy_perform(curl);
+	std::chrono::steady_clock::time_point received = std::chrono::steady_clock::now();
 	curl_easy_cleanup(curl);
+	if (stopRequested) return true;
 	if (res != CURLE_OK)
 	{
 		std::cerr << "\t| Error! Can't get updates." << std::endl;
 		return false;
 	}
 
-	nlohmann::json file = nlohmann::json::parse(buffer);
-	if (file["ok"] && !file["result"].empty())
+	/* The batch is shared by all updates from it, so handlers get views instead of copies */
+	std::shared_ptr<nlohmann::json> file = std::make_shared<nlohmann::json>(nlohmann::json::parse(buffer, nullptr, false));
+	if (file->is_discarded() || !file->is_object())
+	{
+		std::cerr << "\t| Error! Can't parse updates." << std::endl;
+		return false;
+	}
+	std::chrono::steady_clock::time_point parsed = std::chrono::steady_clock::now();
+	if (!file->value("ok", false))
+	{
+		std::cerr << "\t| Error! Can't get updates: " << file->value("description", "unknown error") << "." << std::endl;
+		return false;
+	}
+	auto result = file->find("result");
+	if (result != file->end() && result->is_array())
 	{
-		for (const auto& element:file["result"])
+		if (recorder)
 		{
-			incoming message_data;
-			std::string current = "message";
-			if (element.count("edited_message") != 0)
+			/* Updates are recorded as Telegram sent them, so a replay parses the same text */
+			std::vector<std::pair<size_t, size_t> > spans;
+			if (resultSpans(buffer, spans) && spans.size() == result->size())
 			{
-				current = "edited_message";
+				for (const auto& span:spans) recorder->write(buffer.data() + span.first, span.second - span.first, received);
 			}
-			std::cout << "\tNew message from " << element[current]["from"]["first_name"];
-			std::cout << "(" << element[current]["chat"]["id"] << ")." << std::endl;
-			last_update_id = element["update_id"];
-			message_data.chat_id = element[current]["chat"]["id"];
-			message_data.message_id = element[current]["message_id"];
-			if (element[current].count("photo") != 0)
+			else
 			{
-				for (const auto& image:element[current]["photo"])
+				for (const auto& element:*result)
 				{
-					if (image.count("file_size") != 0)
-					{
-						if (image["file_size"] > 20900000) break;
-					}
-					message_data.photo = image["file_id"];
+					std::string update = element.dump();
+					recorder->write(update.data(), update.size(), received);
 				}
 			}
-			else
+			recorder->flush();
+		}
+		handleUpdates(file, *result, poll_start, received, parsed);
+		for (const auto& element:*result) last_update_id = std::max<unsigned int>(last_update_id, element.value("update_id", 0u));
+		poller->success(result->size(), dispatcher ? dispatcher->backlog() : handlersRunning.load());
+	}
+	else poller->success(0, dispatcher ? dispatcher->backlog() : handlersRunning.load());
+	return true;
+}
+void Telegrab::handleUpdates(const std::shared_ptr<nlohmann::json> &file, const nlohmann::json &result, std::chrono::steady_clock::time_point poll_start, std::chrono::steady_clock::time_point received, std::chrono::steady_clock::time_point parsed)
+{
+	joinHandlers(false);
+	for (const auto& element:result)
+	{
+		Update update(file, &element);
+		unsigned int update_id = update.update_id();
+
+		User from = update.from();
+		std::cout << "\tNew " << update.type() << " from " << from.first_name();
+		long long chat_id = update.message().empty() ? from.id() : update.chat_id();
+		std::cout << "(" << chat_id << ")." << std::endl;
+
+		TraceScope scope(update_id);
+		if (Tracer::context())
+		{
+			Tracer::instance().record("getUpdates", update_id, poll_start, received);
+			Tracer::instance().record("parse", update_id, received, parsed);
+		}
+		if (dispatcher)
+		{
+			TraceSpan span("dispatch");
+			dispatcher->dispatch(chat_id, element.dump());
+			continue;
+		}
+		/* Kept until the handler is done, so a stop can hand over the ones that never started */
+		std::lock_guard<std::mutex> lock(inflightMtx);
+		inflight.emplace(update_id, update);
+		handlersRunning++;
+		unsigned long long number = handlersStarted++;
+		handlerThreads[number] = std::thread([this, update_id, number](Update update, std::chrono::steady_clock::time_point queued)
+		{
+			/* After the shutdown deadline a handler that hasn't started leaves its update to be saved or handed over */
+			bool handled;
+			{
+				std::lock_guard<std::mutex> lock(inflightMtx);
+				handled = !handlersCancelled;
+				if (handled) handling.insert(update_id);
+			}
+			if (handled)
+			{
+				TraceScope scope(update_id);
+				if (Tracer::context()) Tracer::instance().record("queued", Tracer::context(), queued, std::chrono::steady_clock::now());
+				TraceSpan span("Instructions");
+				Instructions(std::move(update));
+			}
+			std::lock_guard<std::mutex> lock(inflightMtx);
+			if (handled)
+			{
+				inflight.erase(update_id);
+				handling.erase(update_id);
+			}
+			handlersDone.push_back(number);
+			handlersRunning--;
+		}, std::move(update), std::chrono::steady_clock::now());
+	}
+}
+/* Joins the handler threads that have returned, or all of them */
+void Telegrab::joinHandlers(bool all)
+{
+	std::vector<std::thread> threads;
+	{
+		std::lock_guard<std::mutex> lock(inflightMtx);
+		if (all)
+		{
+			for (auto& entry:handlerThreads) threads.push_back(std::move(entry.second));
+			handlerThreads.clear();
+		}
+		else
+		{
+			for (unsigned long long number:handlersDone)
 			{
-				message_data.photo = "";
-			}
-			if (element[current].count("video") != 0)
-				message_data.video = element[current]["video"]["file_id"];
-			else message_data.video = "";
-			if (element[current].count("document") != 0)
-				message_data.document = element[current]["document"]["file_id"];
-			else message_data.document = "";
-			if (element[current].count("text") != 0)
-				message_data.text = element[current]["text"];
-			else message_data.text = "";
-			if (element[current].count("audio") != 0)
-				message_data.audio = element[current]["audio"]["file_id"];
-			else message_data.audio = "";
-			if (element[current].count("sticker") != 0)
-				message_data.sticker = element[current]["sticker"]["file_id"];
-			else message_data.sticker = "";
-			if (element[current].count("voice") != 0)
-				message_data.voice = element[current]["voice"]["file_id"];
-			else message_data.voice = "";
-			if (element[current].count("caption") != 0)
-				message_data.caption = element[current]["caption"];
-			else message_data.caption = "";
-			if (element[current].count("entities") != 0)
-			{
-				unsigned short int k = 0;
-				for (const auto& entity:element[current]["entities"])
-				{
-					message_data.entities.push_back("");
-					unsigned short int t1 = entity["offset"];
-					unsigned short int t2 = entity["length"];
-					for (unsigned short int i = t1; i < (t1 + t2); i++)
-					{
-						message_data.entities[k] += message_data.text[i];
-					}
-					k++;
-				}
+				auto it = handlerThreads.find(number);
+				if (it == handlerThreads.end()) continue;
+				threads.push_back(std::move(it->second));
+				handlerThreads.erase(it);
 			}
-
-			std::thread msg(&Telegrab::Instructions, this, message_data);
-			msg.detach();
 		}
+		handlersDone.clear();
 	}
-	return true;
+	for (auto& thread:threads) thread.join();
+}
+void Telegrab::send(content message, long long chat_id, unsigned int reply_to_message_id, Priority priority)
+{
+	TraceSpan span("send");
+	deliver(message, chat_id, reply_to_message_id, priority, nullptr);
 }
-void Telegrab::send(content message, unsigned int chat_id, unsigned int reply_to_message_id)
+void Telegrab::deliver(const content &message, long long chat_id, unsigned int reply_to_message_id, Priority priority, std::vector<SendResult> *results)
 {
 	/* Since we don't know for what file in the message the text refers to,
 	we simply create a boolean 'caption' to let the program know, if the text has already been sent */
 	/* Same goes for rkeyboard */
 	bool caption = false, rkeyboard = false;
+
+	/* Attachments go first, as albums of up to 10 files. Photos and videos can be mixed, documents and audio only with their own kind.
+	Albums can't have a keyboard, so with one the text is sent with the keyboard instead of as a caption */
+	const std::string &album_caption = replyMarkup(message.reply_keyboard, message.hide_reply_keyboard).empty() ? message.text : std::string();
+	for (size_t begin = 0, end; begin < message.attachments.size(); begin = end)
+	{
+		unsigned char type = attachmentType(message.attachments[begin].type);
+		end = begin + 1;
+		if (type == 0)
+		{
+			std::cerr << "\t| Error! Unknown attachment type '" << message.attachments[begin].type << "'." << std::endl;
+			continue;
+		}
+		unsigned char kind = type <= 2 ? 1 : type;
+		while (end < message.attachments.size() && end - begin < 10)
+		{
+			unsigned char next = attachmentType(message.attachments[end].type);
+			if ((next <= 2 ? 1 : next) != kind || next == 0) break;
+			end++;
+		}
+		/* An album needs at least two files */
+		if (end - begin == 1)
+			sendFile(message.attachments[begin].media, album_caption, chat_id, type, caption, rkeyboard, reply_to_message_id, ReplyKeyboardMarkup(), ReplyKeyboardHide(), priority, results);
+		else
+			sendMediaGroup(message.attachments, begin, end, album_caption, chat_id, caption, reply_to_message_id, priority, results);
+	}
+
 	if (!message.photo.empty())
-		sendFile(message.photo, message.text, chat_id, 1, caption, rkeyboard, reply_to_message_id, message.reply_keyboard, message.hide_reply_keyboard);
+		sendFile(message.photo, message.text, chat_id, 1, caption, rkeyboard, reply_to_message_id, message.reply_keyboard, message.hide_reply_keyboard, priority, results);
 	if (!message.video.empty())
-		sendFile(message.video, message.text, chat_id, 2, caption, rkeyboard, reply_to_message_id, message.reply_keyboard, message.hide_reply_keyboard);
+		sendFile(message.video, message.text, chat_id, 2, caption, rkeyboard, reply_to_message_id, message.reply_keyboard, message.hide_reply_keyboard, priority, results);
 	if (!message.document.empty())
-		sendFile(message.document, message.text, chat_id, 3, caption, rkeyboard, reply_to_message_id, message.reply_keyboard, message.hide_reply_keyboard);
+		sendFile(message.document, message.text, chat_id, 3, caption, rkeyboard, reply_to_message_id, message.reply_keyboard, message.hide_reply_keyboard, priority, results);
 	if (!message.audio.empty())
-		sendFile(message.audio, message.text, chat_id, 4, caption, rkeyboard, reply_to_message_id, message.reply_keyboard, message.hide_reply_keyboard);
+		sendFile(message.audio, message.text, chat_id, 4, caption, rkeyboard, reply_to_message_id, message.reply_keyboard, message.hide_reply_keyboard, priority, results);
 	if (!message.sticker.empty())
-		sendFile(message.sticker, message.text, chat_id, 5, caption, rkeyboard, reply_to_message_id, message.reply_keyboard, message.hide_reply_keyboard);
+		sendFile(message.sticker, message.text, chat_id, 5, caption, rkeyboard, reply_to_message_id, message.reply_keyboard, message.hide_reply_keyboard, priority, results);
 	if (!message.text.empty() && !caption)
 	{
-		CURL *curl = CurlInit();
-		if (!curl)
-		{
-			std::cerr << "\t| Error! Can't send a text message to " << chat_id  << ". cURL is not working properly." << std::endl;
-			return;
-		}
-
 		std::cout << "\tSending a message to " << chat_id << "..." << std::endl;
 
-		std::string url = "https://api.telegram.org/bot" + bot_token + "/sendMessage";
-		std::string post_url = "chat_id=" + std::to_string(chat_id) + "&text=" + message.text;
+		RequestBody &body = requestBody();
+		body.add("chat_id", chat_id).add("text", message.text);
 		if (reply_to_message_id != 0)
 		{
-			post_url += "&reply_to_message_id=" + std::to_string(reply_to_message_id);
-		}
-		if (!message.reply_keyboard.keyboard.empty() && !rkeyboard)
-		{
-			nlohmann::json keyboard;
-			unsigned int i = 0, j;
-			for (const auto& element:message.reply_keyboard.keyboard)
-			{
-				j = 0;
-				for (const auto& e:element)
-				{
-					if (!e.text.empty())
-					{
-						keyboard["keyboard"][i][j]["text"] = e.text;
-					}
-					if (e.request_contact == true)
-					{
-						keyboard["keyboard"][i][j]["request_contact"] = true;
-					}
-					if (e.request_location == true)
-					{
-						keyboard["keyboard"][i][j]["request_location"] = true;
-					}
-					j++;
-				}
-				i++;
-			}
-			if (message.reply_keyboard.resize_keyboard == true)
-			{
-				keyboard["resize_keyboard"] = true;
-			}
-			if (message.reply_keyboard.one_time_keyboard == true)
-			{
-				keyboard["one_time_keyboard"] = true;
-			}
-			if (message.reply_keyboard.selective == true)
-			{
-				keyboard["selective"] = true;
-			}
-
-			std::string serialized = keyboard.dump();
-			post_url += "&reply_markup=" + serialized;
-
-			rkeyboard = true;
+			body.add("reply_to_message_id", (long long)reply_to_message_id);
 		}
-		if (message.hide_reply_keyboard.hide == true && !rkeyboard)
+		if (!rkeyboard || message.reply_keyboard.keyboard.empty())
 		{
-			nlohmann::json json;
-			json["hide_keyboard"] = true;
-			if (message.hide_reply_keyboard.selective == true)
-			{
-				json["selective"] = true;
-			}
-
-			std::string serialized = json.dump();
-			post_url += "&reply_markup=" + serialized;
+			const std::string &markup = replyMarkup(message.reply_keyboard, message.hide_reply_keyboard);
+			if (!markup.empty()) body.addJson("reply_markup", markup);
+			if (!message.reply_keyboard.keyboard.empty()) rkeyboard = true;
 		}
 
 		std::string buffer;
-
-		curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-		curl_easy_setopt(curl, CURLOPT_POSTFIELDS, post_url.c_str());
-		curl_easy_setopt(curl, CURLOPT_WRITEDATA, &buffer);
-		CURLcode res = curl_easy_perform(curl);
-		curl_easy_cleanup(curl);
-
-		if (res != CURLE_OK)
+		CURLcode res = CURLE_FAILED_INIT;
+		long http_code = 0;
+		if (!perform(priority, [&](CURL *curl)
+		{
+			curl_easy_setopt(curl, CURLOPT_URL, apiUrl("sendMessage"));
+			setBody(curl, body);
+			curl_easy_setopt(curl, CURLOPT_WRITEDATA, &buffer);
+			res = curl_easy_perform(curl);
+			curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
+		}))
+		{
+			std::cerr << "\t| Error! Can't send a text message to " << chat_id  << ". cURL is not working properly." << std::endl;
+		}
+		else if (res != CURLE_OK)
 		{
 			std::cerr << "\t| Error! Can't send a text message to " << chat_id  << "." << std::endl;
 		}
@@ -459,29 +4174,120 @@ void Telegrab::send(content message, unsigned int chat_id, unsigned int reply_to
 		{
 			std::cout << "\tSuccessfully sent." << std::endl;
 		}
+		if (results) results->push_back(SendResult{0, res, http_code, buffer});
 	}
 }
-void Telegrab::forward(unsigned int message_id, unsigned int chat_id_from, unsigned int chat_id_to)
+bool Telegrab::enqueue(content message, long long chat_id, unsigned int reply_to_message_id, Priority priority)
 {
-	CURL *curl = CurlInit();
-	if (!curl)
+	if (wal)
 	{
-		std::cerr << "\t| Error! Can't forward a message " << message_id << " to " << chat_id_to  << ". cURL is not working properly." << std::endl;
-		return;
+		nlohmann::json record;
+		record["message"] = message;
+		record["chat_id"] = chat_id;
+		record["reply_to_message_id"] = reply_to_message_id;
+		record["priority"] = static_cast<int>(priority);
+		unsigned long long id = wal->append(record.dump());
+		if (id != 0)
+		{
+			QueuedMessage item = {id, message, chat_id, reply_to_message_id, priority, 0};
+			schedule(item, std::chrono::steady_clock::now());
+			return true;
+		}
+		std::cerr << "\t| Error! Can't write the message to the outbound queue, sending it without retries." << std::endl;
+	}
+	/* Without the queue the message is sent right away, and the caller learns it's not kept */
+	send(message, chat_id, reply_to_message_id, priority);
+	return false;
+}
+void Telegrab::schedule(QueuedMessage item, std::chrono::steady_clock::time_point due)
+{
+	{
+		std::lock_guard<std::mutex> lock(queueMtx);
+		queued.insert(std::make_pair(due, std::move(item)));
 	}
+	queueReady.notify_one();
+}
+void Telegrab::queueWorker()
+{
+	static thread_local std::mt19937 random(std::random_device{}());
+	std::vector<SendResult> results;
+	std::unique_lock<std::mutex> lock(queueMtx);
+	while (!queueStopping)
+	{
+		if (queued.empty())
+		{
+			queueReady.wait(lock);
+			continue;
+		}
+		if (queued.begin()->first > std::chrono::steady_clock::now())
+		{
+			queueReady.wait_until(lock, queued.begin()->first);
+			continue;
+		}
+		QueuedMessage item = std::move(queued.begin()->second);
+		queued.erase(queued.begin());
+		lock.unlock();
 
+		results.clear();
+		deliver(item.message, item.chat_id, item.reply_to_message_id, item.priority, &results);
+
+		const SendResult *failure = nullptr;
+		for (const auto& result:results)
+		{
+			if (result.code != CURLE_OK || result.http_code != 200)
+			{
+				failure = &result;
+				break;
+			}
+		}
+		bool retry = failure && (failure->code != CURLE_OK || failure->http_code == 429 || failure->http_code >= 500);
+		if (retry)
+		{
+			/* Exponential backoff with jitter, so that retries after an outage don't come all at once */
+			unsigned int limit = std::min<unsigned long long>(queueMaxBackoff * 1000ull, 1000ull << std::min(item.attempt, 20u));
+			unsigned int delay = std::uniform_int_distribution<unsigned int>(limit / 2, limit)(random);
+			if (failure->http_code == 429)
+			{
+				nlohmann::json response = nlohmann::json::parse(failure->response, nullptr, false);
+				if (response.is_object() && response.count("parameters") != 0)
+				{
+					delay = std::max(delay, response["parameters"].value("retry_after", 0u) * 1000);
+				}
+			}
+			std::cerr << "\t| Error! Can't send a queued message to " << item.chat_id << ". Retrying in " << delay / 1000.0 << " seconds..." << std::endl;
+			item.attempt++;
+			schedule(std::move(item), std::chrono::steady_clock::now() + std::chrono::milliseconds(delay));
+		}
+		else
+		{
+			if (failure)
+			{
+				std::cerr << "\t| Error! Telegram rejected a queued message to " << item.chat_id << " (" << failure->http_code << "), dropping it." << std::endl;
+			}
+			wal->ack(item.id);
+		}
+		lock.lock();
+	}
+}
+void Telegrab::forward(unsigned int message_id, long long chat_id_from, long long chat_id_to, Priority priority)
+{
 	std::cout << "\tForwarding the message " << message_id << " to " << chat_id_to << "..." << std::endl;
 
 	std::string buffer;
-	std::string url = "https://api.telegram.org/bot" + bot_token + "/forwardMessage";
-	std::string post_url = "chat_id=" + std::to_string(chat_id_to) + "&from_chat_id=" + std::to_string(chat_id_from) + "&message_id=" + std::to_string(message_id);
-	curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-	curl_easy_setopt(curl, CURLOPT_POSTFIELDS, post_url.c_str());
-	curl_easy_setopt(curl, CURLOPT_WRITEDATA, &buffer);
-	CURLcode res = curl_easy_perform(curl);
-	curl_easy_cleanup(curl);
-
-	if (res != CURLE_OK)
+	RequestBody &body = requestBody();
+	body.add("chat_id", chat_id_to).add("from_chat_id", chat_id_from).add("message_id", (long long)message_id);
+	CURLcode res = CURLE_FAILED_INIT;
+	if (!perform(priority, [&](CURL *curl)
+	{
+		curl_easy_setopt(curl, CURLOPT_URL, apiUrl("forwardMessage"));
+		setBody(curl, body);
+		curl_easy_setopt(curl, CURLOPT_WRITEDATA, &buffer);
+		res = curl_easy_perform(curl);
+	}))
+	{
+		std::cerr << "\t| Error! Can't forward a message " << message_id << " to " << chat_id_to  << ". cURL is not working properly." << std::endl;
+	}
+	else if (res != CURLE_OK)
 	{
 		std::cerr << "\t| Error! Can't forward a message " << message_id << " to " << chat_id_to  << "." << std::endl;
 	}
@@ -490,267 +4296,486 @@ void Telegrab::forward(unsigned int message_id, unsigned int chat_id_from, unsig
 		std::cout << "\tSuccessfully sent." << std::endl;
 	}
 }
-void Telegrab::sendFile(std::string name, std::string text, unsigned int chat_id, unsigned char type, bool &caption, bool &rkeyboard, unsigned int reply_to_message_id, ReplyKeyboardMarkup reply_keyboard, ReplyKeyboardHide hide_reply_keyboard)
+void Telegrab::answerCallbackQuery(std::string callback_query_id, std::string text, bool show_alert)
 {
-	std::cout << "\tSending a file to " << chat_id << "..." << std::endl;
-	std::string buffer, url = "https://api.telegram.org/bot" + bot_token;
-	std::ifstream file(name);
-	if (file.is_open())
+	std::string buffer;
+	RequestBody &body = requestBody();
+	body.add("callback_query_id", callback_query_id);
+	if (!text.empty())
 	{
-		file.close();
+		body.add("text", text);
+	}
+	if (show_alert)
+	{
+		body.add("show_alert", true);
+	}
+	/* The user is waiting for the spinner on the button to stop */
+	CURLcode res = CURLE_FAILED_INIT;
+	if (!perform(Priority::Interactive, [&](CURL *curl)
+	{
+		curl_easy_setopt(curl, CURLOPT_URL, apiUrl("answerCallbackQuery"));
+		setBody(curl, body);
+		curl_easy_setopt(curl, CURLOPT_WRITEDATA, &buffer);
+		res = curl_easy_perform(curl);
+	}))
+	{
+		std::cerr << "\t| Error! Can't answer a callback query " << callback_query_id << ". cURL is not working properly." << std::endl;
+	}
+	else if (res != CURLE_OK)
+	{
+		std::cerr << "\t| Error! Can't answer a callback query " << callback_query_id << "." << std::endl;
+	}
+}
+void Telegrab::editMessageText(long long chat_id, unsigned int message_id, std::string text, Priority priority)
+{
+	editText(chat_id, message_id, text, priority, nullptr);
+}
+void Telegrab::editText(long long chat_id, unsigned int message_id, const std::string &text, Priority priority, std::vector<SendResult> *results)
+{
+	std::cout << "\tEditing the message " << message_id << " in " << chat_id << "..." << std::endl;
 
-		CURL *curl_multipart = CurlInit();
-		curl_mime *form = nullptr;
-		curl_mimepart *field = nullptr;
-		curl_easy_setopt(curl_multipart, CURLOPT_WRITEDATA, &buffer);
-		curl_easy_setopt(curl_multipart, CURLOPT_POST, 0);
-		if (!curl_multipart)
+	std::string buffer;
+	RequestBody &body = requestBody();
+	body.add("chat_id", chat_id).add("message_id", (long long)message_id).add("text", text);
+	CURLcode res = CURLE_FAILED_INIT;
+	long http_code = 0;
+	if (!perform(priority, [&](CURL *curl)
+	{
+		curl_easy_setopt(curl, CURLOPT_URL, apiUrl("editMessageText"));
+		setBody(curl, body);
+		curl_easy_setopt(curl, CURLOPT_WRITEDATA, &buffer);
+		res = curl_easy_perform(curl);
+		curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
+	}))
+	{
+		std::cerr << "\t| Error! Can't edit the message " << message_id << " in " << chat_id << ". cURL is not working properly." << std::endl;
+	}
+	else if (res != CURLE_OK)
+	{
+		std::cerr << "\t| Error! Can't edit the message " << message_id << " in " << chat_id << "." << std::endl;
+	}
+	else
+	{
+		std::cout << "\tSuccessfully edited." << std::endl;
+	}
+	if (results) results->push_back(SendResult{0, res, http_code, buffer});
+}
+MessageStream Telegrab::stream(long long chat_id, unsigned int reply_to_message_id, Priority priority)
+{
+	std::shared_ptr<MessageStream::State> state = std::make_shared<MessageStream::State>();
+	state->chat_id = chat_id;
+	state->reply_to_message_id = reply_to_message_id;
+	state->priority = priority;
+	state->start = 0;
+	state->message_id = 0;
+	state->scheduled = false;
+	state->flushing = false;
+	state->closed = false;
+	state->failed = false;
+	{
+		/* Senders are started with the first stream */
+		std::lock_guard<std::mutex> lock(streamMtx);
+		while (streamWorkers.size() < streamSenders)
 		{
-			std::cerr << "\t| Error! Can't send a file to " << chat_id  << ". cURL is not working properly." << std::endl;
-			return;
+			streamWorkers.emplace_back(&Telegrab::streamWorker, this);
 		}
-
-		form = curl_mime_init(curl_multipart);
-		field = curl_mime_addpart(form);
-
-		switch (type)
+	}
+	return MessageStream(this, state);
+}
+void Telegrab::scheduleStream(const std::shared_ptr<MessageStream::State> &state, std::chrono::steady_clock::time_point due)
+{
+	{
+		std::lock_guard<std::mutex> lock(streamMtx);
+		streams.emplace(due, state);
+	}
+	streamReady.notify_one();
+}
+void Telegrab::streamWorker()
+{
+	std::unique_lock<std::mutex> lock(streamMtx);
+	while (true)
+	{
+		if (streams.empty())
 		{
-			case 1:
-				url += "/sendPhoto";
-				curl_mime_name(field, "photo");
-				break;
-			case 2:
-				url += "/sendVideo";
-				curl_mime_name(field, "video");
-				break;
-			case 3:
-				url += "/sendDocument";
-				curl_mime_name(field, "document");
-				break;
-			case 4:
-				url += "/sendAudio";
-				curl_mime_name(field, "audio");
-				break;
-			case 5:
-				url += "/sendSticker";
-				curl_mime_name(field, "sticker");
-				break;
+			if (streamStopping) break;
+			streamReady.wait(lock);
+			continue;
 		}
-
-		curl_mime_filedata(field, name.c_str());
-		field = curl_mime_addpart(form);
-		curl_mime_name(field, "chat_id");
-		curl_mime_data(field, std::to_string(chat_id).c_str(), CURL_ZERO_TERMINATED);
-		if (!text.empty() && !caption && type != 5)
+		/* While the bot stops, what's left is sent without waiting for the next edit */
+		bool final = streamStopping;
+		if (!final && streams.begin()->first > std::chrono::steady_clock::now())
 		{
-			field = curl_mime_addpart(form);
-			curl_mime_name(field, "caption");
-			curl_mime_data(field, text.c_str(), CURL_ZERO_TERMINATED);
-			caption = true;
+			streamReady.wait_until(lock, streams.begin()->first);
+			continue;
 		}
-		if (reply_to_message_id != 0)
+		std::shared_ptr<MessageStream::State> state = streams.begin()->second;
+		streams.erase(streams.begin());
+		lock.unlock();
+		flushStream(state, final);
+		lock.lock();
+	}
+}
+/* Brings the messages of a stream up to its text: sends the last message or edits it, and moves on to a new one when it's full.
+Every request waits for the interval after the previous one. Unless it's the final flush, the text that has to wait is scheduled again */
+void Telegrab::flushStream(const std::shared_ptr<MessageStream::State> &state, bool final)
+{
+	MessageStream::State &s = *state;
+	std::vector<SendResult> results;
+	std::unique_lock<std::mutex> lock(s.mtx);
+	s.flushed.wait(lock, [&s]{ return !s.flushing; });
+	s.flushing = true;
+	s.scheduled = false;
+	bool later = false;
+	unsigned int attempts = 0;
+	while (!s.failed)
+	{
+		/* Telegram takes up to 4096 characters in a message */
+		size_t cut = splitText(s.text, s.start, 4096);
+		std::string part = s.text.substr(s.start, cut == std::string::npos ? std::string::npos : cut - s.start);
+		/* Telegram strips the whitespace around the text, so only the rest can change the message */
+		size_t first = part.find_first_not_of(" \t\r\n");
+		if (first != std::string::npos) part = part.substr(first, part.find_last_not_of(" \t\r\n") + 1 - first);
+		if (part == s.shown || first == std::string::npos)
 		{
-			field = curl_mime_addpart(form);
-			curl_mime_name(field, "reply_to_message_id");
-			curl_mime_data(field, std::to_string(reply_to_message_id).c_str(), CURL_ZERO_TERMINATED);
+			if (cut == std::string::npos) break;
+			s.start = cut;
+			s.message_id = 0;
+			s.shown.clear();
+			continue;
 		}
-		if (!reply_keyboard.keyboard.empty() && !rkeyboard)
+		if (std::chrono::steady_clock::now() < s.next)
 		{
-			nlohmann::json keyboard;
-			unsigned int i = 0, j;
-			for (const auto& element:reply_keyboard.keyboard)
-			{
-				j = 0;
-				for (const auto& e:element)
-				{
-					if (!e.text.empty())
-					{
-						keyboard["keyboard"][i][j]["text"] = e.text;
-					}
-					if (e.request_contact == true)
-					{
-						keyboard["keyboard"][i][j]["request_contact"] = true;
-					}
-					if (e.request_location == true)
-					{
-						keyboard["keyboard"][i][j]["request_location"] = true;
-					}
-					j++;
-				}
-				i++;
-			}
-			if (reply_keyboard.resize_keyboard == true)
-			{
-				keyboard["resize_keyboard"] = true;
-			}
-			if (reply_keyboard.one_time_keyboard == true)
-			{
-				keyboard["one_time_keyboard"] = true;
-			}
-			if (reply_keyboard.selective == true)
+			if (!final)
 			{
-				keyboard["selective"] = true;
+				later = true;
+				break;
 			}
+			std::chrono::steady_clock::time_point next = s.next;
+			lock.unlock();
+			std::this_thread::sleep_until(next);
+			lock.lock();
+			continue;
+		}
 
-			std::string serialized = keyboard.dump();
-			field = curl_mime_addpart(form);
-			curl_mime_name(field, "reply_markup");
-			curl_mime_data(field, serialized.c_str(), CURL_ZERO_TERMINATED);
+		unsigned int message_id = s.message_id;
+		unsigned int reply_to_message_id = s.messages.empty() ? s.reply_to_message_id : 0;
+		lock.unlock();
+		results.clear();
+		if (message_id == 0)
+		{
+			content message = {};
+			message.text = part;
+			deliver(message, s.chat_id, reply_to_message_id, s.priority, &results);
+		}
+		else editText(s.chat_id, message_id, part, s.priority, &results);
+		lock.lock();
 
-			rkeyboard = true;
+		const SendResult &result = results.back();
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		s.next = now + std::chrono::milliseconds(streamInterval);
+		/* The message already has this text, i.e. the previous edit got through but its answer didn't */
+		bool unchanged = message_id != 0 && result.code == CURLE_OK && result.http_code == 400 && result.response.find("message is not modified") != std::string::npos;
+		/* Without the id of a new message the next text couldn't be edited into it, so such an answer counts as a failure */
+		unsigned int sent_id = 0;
+		if (message_id == 0 && result.code == CURLE_OK && result.http_code == 200)
+		{
+			nlohmann::json response = nlohmann::json::parse(result.response, nullptr, false);
+			if (response.is_object() && response["result"].is_object()) sent_id = response["result"].value("message_id", 0u);
 		}
-		if (hide_reply_keyboard.hide == true && !rkeyboard)
+		bool garbled = message_id == 0 && result.code == CURLE_OK && result.http_code == 200 && sent_id == 0;
+		if (result.code == CURLE_OK && (result.http_code == 200 || unchanged) && !garbled)
 		{
-			nlohmann::json json;
-			json["hide_keyboard"] = true;
-			if (hide_reply_keyboard.selective == true)
+			if (message_id == 0)
 			{
-				json["selective"] = true;
+				s.message_id = sent_id;
+				s.messages.push_back(sent_id);
 			}
-
-			std::string serialized = json.dump();
-			field = curl_mime_addpart(form);
-			curl_mime_name(field, "reply_markup");
-			curl_mime_data(field, serialized.c_str(), CURL_ZERO_TERMINATED);
+			s.shown = part;
+			attempts = 0;
 		}
-
-		curl_easy_setopt(curl_multipart, CURLOPT_URL, url.c_str());
-		curl_easy_setopt(curl_multipart, CURLOPT_MIMEPOST, form);
-		CURLcode res = curl_easy_perform(curl_multipart);
-		if (res != CURLE_OK)
+		else if ((result.code != CURLE_OK || result.http_code == 429 || result.http_code >= 500 || garbled) && attempts < 5)
+		{
+			attempts++;
+			if (result.http_code == 429)
+			{
+				nlohmann::json response = nlohmann::json::parse(result.response, nullptr, false);
+				if (response.is_object() && response.count("parameters") != 0)
+				{
+					s.next = std::max(s.next, now + std::chrono::seconds(response["parameters"].value("retry_after", 0u)));
+				}
+			}
+		}
+		else if (message_id != 0)
 		{
-			std::cerr << "\t| Error! Can't send a file to " << chat_id  << ". Perhaps the file is too large." << std::endl;
+			/* The message can't be edited anymore (i.e. it was deleted), the text goes on in a new one */
+			std::cerr << "\t| Error! Can't edit the message " << message_id << " in " << s.chat_id << " (" << result.http_code << "), continuing in a new message." << std::endl;
+			s.message_id = 0;
+			s.shown.clear();
+			attempts = 0;
 		}
 		else
 		{
-			std::cout << "\tSuccessfully sent." << std::endl;
+			std::cerr << "\t| Error! Can't send the message stream to " << s.chat_id << " (" << result.http_code << "), dropping it." << std::endl;
+			s.failed = true;
 		}
-
-		curl_easy_cleanup(curl_multipart);
-		curl_mime_free(form);
 	}
-	else
+	s.flushing = false;
+	bool schedule = later && !s.scheduled;
+	if (schedule) s.scheduled = true;
+	std::chrono::steady_clock::time_point due = s.next;
+	lock.unlock();
+	s.flushed.notify_all();
+	if (schedule) scheduleStream(state, due);
+}
+MessageStream::~MessageStream()
+{
+	close();
+}
+MessageStream &MessageStream::operator<<(const std::string &text)
+{
+	append(text);
+	return *this;
+}
+void MessageStream::append(const std::string &text)
+{
+	if (!state || text.empty()) return;
+	std::unique_lock<std::mutex> lock(state->mtx);
+	if (state->closed || state->failed) return;
+	state->text += text;
+	/* A flush that is running schedules the rest itself */
+	if (state->scheduled || state->flushing) return;
+	state->scheduled = true;
+	std::chrono::steady_clock::time_point due = state->next;
+	lock.unlock();
+	bot->scheduleStream(state, due);
+}
+void MessageStream::close()
+{
+	if (!state) return;
 	{
-		CURL *curl = CurlInit();
-		if (!curl)
-		{
-			std::cerr << "\t| Error! Can't send a file to " << chat_id  << ". cURL is not working properly." << std::endl;
-			return;
-		}
+		std::lock_guard<std::mutex> lock(state->mtx);
+		if (state->closed) return;
+		state->closed = true;
+	}
+	bot->flushStream(state, true);
+}
+std::vector<unsigned int> MessageStream::messages()
+{
+	if (!state) return std::vector<unsigned int>();
+	std::lock_guard<std::mutex> lock(state->mtx);
+	return state->messages;
+}
+void Telegrab::sendMediaGroup(const std::vector<Attachment> &attachments, size_t begin, size_t end, const std::string &text, long long chat_id, bool &caption, unsigned int reply_to_message_id, Priority priority, std::vector<SendResult> *results)
+{
+	std::cout << "\tSending " << end - begin << " files to " << chat_id << "..." << std::endl;
 
-		std::string post_url = "chat_id=" + std::to_string(chat_id);
-		switch (type)
+	/* Local files are uploaded as parts of the request named in 'media' as attach://fileN, the rest are file_ids or URLs */
+	nlohmann::json media = nlohmann::json::array();
+	std::vector<std::pair<std::string, const std::string*>> uploads;
+	bool captioned = false;
+	for (size_t i = begin; i < end; i++)
+	{
+		nlohmann::json item = {{"type", attachments[i].type}, {"media", attachments[i].media}};
+		std::ifstream file(attachments[i].media);
+		if (file.is_open())
 		{
-			case 1:
-				url += "/sendPhoto";
-				post_url += "&photo=" + name;
-				break;
-			case 2:
-				url += "/sendVideo";
-				post_url += "&video=" + name;
-				break;
-			case 3:
-				url += "/sendDocument";
-				post_url += "&document=" + name;
-				break;
-			case 4:
-				url += "/sendAudio";
-				post_url += "&audio=" + name;
-				break;
-			case 5:
-				url += "/sendSticker";
-				post_url += "&sticker=" + name;
-				break;
+			uploads.emplace_back("file" + std::to_string(uploads.size()), &attachments[i].media);
+			item["media"] = "attach://" + uploads.back().first;
 		}
-		if (!text.empty() && !caption && type != 5)
+		if (!text.empty() && !caption && !captioned)
 		{
-			post_url += "&caption=" + text;
-			caption = true;
+			item["caption"] = text;
+			captioned = true;
 		}
+		media.push_back(item);
+	}
+	std::string media_json = media.dump(-1, ' ', false, nlohmann::json::error_handler_t::replace);
+
+	std::string buffer;
+	CURLcode res = CURLE_FAILED_INIT;
+	long http_code = 0;
+	bool ok;
+	if (!uploads.empty())
+	{
+		ok = perform(priority, [&](CURL *curl_multipart)
+		{
+			curl_mimepart *field = nullptr;
+			curl_easy_setopt(curl_multipart, CURLOPT_WRITEDATA, &buffer);
+			curl_easy_setopt(curl_multipart, CURLOPT_POST, 0);
+
+			curl_mime *form = curl_mime_init(curl_multipart);
+			field = curl_mime_addpart(form);
+			curl_mime_name(field, "chat_id");
+			curl_mime_data(field, std::to_string(chat_id).c_str(), CURL_ZERO_TERMINATED);
+			field = curl_mime_addpart(form);
+			curl_mime_name(field, "media");
+			curl_mime_data(field, media_json.data(), media_json.size());
+			if (reply_to_message_id != 0)
+			{
+				field = curl_mime_addpart(form);
+				curl_mime_name(field, "reply_to_message_id");
+				curl_mime_data(field, std::to_string(reply_to_message_id).c_str(), CURL_ZERO_TERMINATED);
+			}
+			for (const auto& upload:uploads)
+			{
+				field = curl_mime_addpart(form);
+				curl_mime_name(field, upload.first.c_str());
+				curl_mime_filedata(field, upload.second->c_str());
+			}
+
+			curl_easy_setopt(curl_multipart, CURLOPT_URL, apiUrl("sendMediaGroup"));
+			curl_easy_setopt(curl_multipart, CURLOPT_MIMEPOST, form);
+			res = curl_easy_perform(curl_multipart);
+			curl_easy_getinfo(curl_multipart, CURLINFO_RESPONSE_CODE, &http_code);
+			curl_mime_free(form);
+		});
+	}
+	else
+	{
+		RequestBody &body = requestBody();
+		body.add("chat_id", chat_id).addJson("media", media_json);
 		if (reply_to_message_id != 0)
 		{
-			post_url += "&reply_to_message_id=" + std::to_string(reply_to_message_id);
+			body.add("reply_to_message_id", (long long)reply_to_message_id);
 		}
-		if (!reply_keyboard.keyboard.empty() && !rkeyboard)
+		ok = perform(priority, [&](CURL *curl)
+		{
+			curl_easy_setopt(curl, CURLOPT_URL, apiUrl("sendMediaGroup"));
+			setBody(curl, body);
+			curl_easy_setopt(curl, CURLOPT_WRITEDATA, &buffer);
+			res = curl_easy_perform(curl);
+			curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
+		});
+	}
+
+	if (!ok)
+	{
+		std::cerr << "\t| Error! Can't send files to " << chat_id  << ". cURL is not working properly." << std::endl;
+	}
+	else if (res != CURLE_OK)
+	{
+		std::cerr << "\t| Error! Can't send files to " << chat_id  << ". Perhaps they are too large." << std::endl;
+	}
+	else
+	{
+		std::cout << "\tSuccessfully sent." << std::endl;
+	}
+	/* The text is shown only if the album was, otherwise it's left to be sent on its own */
+	if (captioned && ok && res == CURLE_OK && http_code == 200) caption = true;
+	/* Type 6 - an album, its response is an array of messages */
+	if (results) results->push_back(SendResult{6, res, http_code, buffer});
+}
+void Telegrab::sendFile(const std::string &name, const std::string &text, long long chat_id, unsigned char type, bool &caption, bool &rkeyboard, unsigned int reply_to_message_id, const ReplyKeyboardMarkup &reply_keyboard, const ReplyKeyboardHide &hide_reply_keyboard, Priority priority, std::vector<SendResult> *results)
+{
+	static const char *methods[] = {"", "sendPhoto", "sendVideo", "sendDocument", "sendAudio", "sendSticker"};
+	static const char *fields[] = {"", "photo", "video", "document", "audio", "sticker"};
+	if (type < 1 || type > 5) return;
+
+	std::cout << "\tSending a file to " << chat_id << "..." << std::endl;
+	std::string buffer;
+	CURLcode res = CURLE_FAILED_INIT;
+	long http_code = 0;
+	bool ok;
+	std::ifstream file(name);
+	if (file.is_open())
+	{
+		file.close();
+
+		/* The form is bound to the pooled handle, so it's built right before the request */
+		ok = perform(priority, [&](CURL *curl_multipart)
 		{
-			nlohmann::json keyboard;
-			unsigned int i = 0, j;
-			for (const auto& element:reply_keyboard.keyboard)
-			{
-				j = 0;
-				for (const auto& e:element)
-				{
-					if (!e.text.empty())
-					{
-						keyboard["keyboard"][i][j]["text"] = e.text;
-					}
-					if (e.request_contact == true)
-					{
-						keyboard["keyboard"][i][j]["request_contact"] = true;
-					}
-					if (e.request_location == true)
-					{
-						keyboard["keyboard"][i][j]["request_location"] = true;
-					}
-					j++;
-				}
-				i++;
-			}
-			if (reply_keyboard.resize_keyboard == true)
+			curl_mime *form = nullptr;
+			curl_mimepart *field = nullptr;
+			curl_easy_setopt(curl_multipart, CURLOPT_WRITEDATA, &buffer);
+			curl_easy_setopt(curl_multipart, CURLOPT_POST, 0);
+
+			form = curl_mime_init(curl_multipart);
+			field = curl_mime_addpart(form);
+			curl_mime_name(field, fields[type]);
+			curl_mime_filedata(field, name.c_str());
+			field = curl_mime_addpart(form);
+			curl_mime_name(field, "chat_id");
+			curl_mime_data(field, std::to_string(chat_id).c_str(), CURL_ZERO_TERMINATED);
+			if (!text.empty() && !caption && type != 5)
 			{
-				keyboard["resize_keyboard"] = true;
+				field = curl_mime_addpart(form);
+				curl_mime_name(field, "caption");
+				curl_mime_data(field, text.data(), text.size());
+				caption = true;
 			}
-			if (reply_keyboard.one_time_keyboard == true)
+			if (reply_to_message_id != 0)
 			{
-				keyboard["one_time_keyboard"] = true;
+				field = curl_mime_addpart(form);
+				curl_mime_name(field, "reply_to_message_id");
+				curl_mime_data(field, std::to_string(reply_to_message_id).c_str(), CURL_ZERO_TERMINATED);
 			}
-			if (reply_keyboard.selective == true)
+			if (!rkeyboard || reply_keyboard.keyboard.empty())
 			{
-				keyboard["selective"] = true;
+				const std::string &markup = replyMarkup(reply_keyboard, hide_reply_keyboard);
+				if (!markup.empty())
+				{
+					field = curl_mime_addpart(form);
+					curl_mime_name(field, "reply_markup");
+					curl_mime_data(field, markup.data(), markup.size());
+				}
+				if (!reply_keyboard.keyboard.empty()) rkeyboard = true;
 			}
 
-			std::string serialized = keyboard.dump();
-			post_url += "&reply_markup=" + serialized;
-
-			rkeyboard = true;
-		}
-		if (hide_reply_keyboard.hide == true && !rkeyboard)
+			curl_easy_setopt(curl_multipart, CURLOPT_URL, apiUrl(methods[type]));
+			curl_easy_setopt(curl_multipart, CURLOPT_MIMEPOST, form);
+			res = curl_easy_perform(curl_multipart);
+			curl_easy_getinfo(curl_multipart, CURLINFO_RESPONSE_CODE, &http_code);
+			curl_mime_free(form);
+		});
+	}
+	else
+	{
+		/* file_id or URL */
+		RequestBody &body = requestBody();
+		body.add("chat_id", chat_id).add(fields[type], name);
+		if (!text.empty() && !caption && type != 5)
 		{
-			nlohmann::json json;
-			json["hide_keyboard"] = true;
-			if (hide_reply_keyboard.selective == true)
-			{
-				json["selective"] = true;
-			}
-
-			std::string serialized = json.dump();
-			post_url += "&reply_markup=" + serialized;
+			body.add("caption", text);
+			caption = true;
 		}
-
-		curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-		curl_easy_setopt(curl, CURLOPT_POSTFIELDS, post_url.c_str());
-		curl_easy_setopt(curl, CURLOPT_WRITEDATA, &buffer);
-		CURLcode res = curl_easy_perform(curl);
-		curl_easy_cleanup(curl);
-		if (res != CURLE_OK)
+		if (reply_to_message_id != 0)
 		{
-			std::cerr << "\t| Error! Can't send " << name << " to " << chat_id  << "." << std::endl;
+			body.add("reply_to_message_id", (long long)reply_to_message_id);
 		}
-		else
+		if (!rkeyboard || reply_keyboard.keyboard.empty())
 		{
-			std::cout << "\tSuccessfully sent." << std::endl;
+			const std::string &markup = replyMarkup(reply_keyboard, hide_reply_keyboard);
+			if (!markup.empty()) body.addJson("reply_markup", markup);
+			if (!reply_keyboard.keyboard.empty()) rkeyboard = true;
 		}
+
+		ok = perform(priority, [&](CURL *curl)
+		{
+			curl_easy_setopt(curl, CURLOPT_URL, apiUrl(methods[type]));
+			setBody(curl, body);
+			curl_easy_setopt(curl, CURLOPT_WRITEDATA, &buffer);
+			res = curl_easy_perform(curl);
+			curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
+		});
+	}
+
+	if (!ok)
+	{
+		std::cerr << "\t| Error! Can't send a file to " << chat_id  << ". cURL is not working properly." << std::endl;
 	}
+	else if (res != CURLE_OK)
+	{
+		std::cerr << "\t| Error! Can't send " << name << " to " << chat_id  << ". Perhaps the file is too large." << std::endl;
+	}
+	else
+	{
+		std::cout << "\tSuccessfully sent." << std::endl;
+	}
+	if (results) results->push_back(SendResult{type, res, http_code, buffer});
 }
 std::string Telegrab::download(std::string given)
 {
-	CURL *curl = CurlInit();
-	if (!curl)
-	{
-		std::cerr << "\t| Error! Can't download " << given << ". cURL is not working properly." << std::endl;
-		return "";
-	}
-
+	TraceSpan span("download");
 	std::cout << "\tTrying to download " << given << "..." << std::endl;
 
 	if (given.empty())
@@ -766,17 +4791,23 @@ std::string Telegrab::download(std::string given)
 		last_file_id++;
 		mtx.unlock();
 
-		curl_easy_setopt(curl, CURLOPT_URL, given.c_str());
-		curl_easy_setopt(curl, CURLOPT_POST, 0);
-
 		/* File download */
 		std::ofstream file(file_path, std::ios_base::out | std::ios_base::binary);
 		if (file.is_open())
 		{
-			curl_easy_setopt(curl, CURLOPT_WRITEDATA, &file);
-			curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curlFileWriter);
-			CURLcode res = curl_easy_perform(curl);
-			curl_easy_cleanup(curl);
+			CURLcode res = CURLE_FAILED_INIT;
+			if (!perform(Priority::Normal, [&](CURL *curl)
+			{
+				curl_easy_setopt(curl, CURLOPT_URL, given.c_str());
+				curl_easy_setopt(curl, CURLOPT_POST, 0);
+				curl_easy_setopt(curl, CURLOPT_WRITEDATA, &file);
+				curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curlFileWriter);
+				res = curl_easy_perform(curl);
+			}))
+			{
+				std::cerr << "\t| Error! Can't download " << given << ". cURL is not working properly." << std::endl;
+				return "";
+			}
 			file.close();
 			if (res != CURLE_OK)
 			{
@@ -790,12 +4821,20 @@ std::string Telegrab::download(std::string given)
 	else
 	{
 		std::string buffer;
-		std::string url = "https://api.telegram.org/bot" + bot_token + "/getFile", post_url = "file_id=" + given;
-		curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-		curl_easy_setopt(curl, CURLOPT_POSTFIELDS, post_url.c_str());
-		curl_easy_setopt(curl, CURLOPT_WRITEDATA, &buffer);
-		CURLcode res = curl_easy_perform(curl);
-		curl_easy_cleanup(curl);
+		RequestBody &body = requestBody();
+		body.add("file_id", given);
+		CURLcode res = CURLE_FAILED_INIT;
+		if (!perform(Priority::Normal, [&](CURL *curl)
+		{
+			curl_easy_setopt(curl, CURLOPT_URL, apiUrl("getFile"));
+			setBody(curl, body);
+			curl_easy_setopt(curl, CURLOPT_WRITEDATA, &buffer);
+			res = curl_easy_perform(curl);
+		}))
+		{
+			std::cerr << "\t| Error! Can't download " << given << ". cURL is not working properly." << std::endl;
+			return "";
+		}
 		if (res != CURLE_OK)
 		{
 			std::cerr << "\t| Error! Can't get a file_path to download the file." << std::endl;
@@ -822,24 +4861,23 @@ std::string Telegrab::download(std::string given)
 			}
 			if (err != -1)
 			{
-				curl = CurlInit();
-				if (!curl)
-				{
-					std::cerr << "\t| Error! Can't download " << given << ". cURL is not working properly." << std::endl;
-					return "";
-				}
-
-				url = "https://api.telegram.org/file/bot" + bot_token + "/" + file_path;
+				std::string url = server() + "/file/bot" + bot_token + "/" + file_path;
 
 				std::ofstream file(path, std::ios_base::out | std::ios_base::binary);
 				if (file.is_open())
 				{
-					curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-					curl_easy_setopt(curl, CURLOPT_WRITEDATA, &file);
-					curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curlFileWriter);
-					curl_easy_setopt(curl, CURLOPT_POST, 0);
-					res = curl_easy_perform(curl);
-					curl_easy_cleanup(curl);
+					if (!perform(Priority::Normal, [&](CURL *curl)
+					{
+						curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+						curl_easy_setopt(curl, CURLOPT_WRITEDATA, &file);
+						curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curlFileWriter);
+						curl_easy_setopt(curl, CURLOPT_POST, 0);
+						res = curl_easy_perform(curl);
+					}))
+					{
+						std::cerr << "\t| Error! Can't download " << given << ". cURL is not working properly." << std::endl;
+						return "";
+					}
 					file.close();
 					if (res != CURLE_OK)
 					{
@@ -852,7 +4890,6 @@ std::string Telegrab::download(std::string given)
 				else
 				{
 					std::cerr << "\t| Error! Can't download " << given << ". Error creating new file." << std::endl;
-					curl_easy_cleanup(curl);
 				}
 			}
 			else std::cerr << "\t| Error! Can't create a folder for the file." << std::endl;
@@ -861,27 +4898,552 @@ std::string Telegrab::download(std::string given)
 	}
 	return "";
 }
+/* file_id of the file of the given kind in a sent message, or 'fallback' if there is none */
+static std::string sentFileId(const nlohmann::json &sent, const std::string &kind, const std::string &fallback)
+{
+	if (!sent.is_object() || sent.count(kind) == 0) return fallback;
+	const nlohmann::json &file = sent[kind];
+	/* Photos come in several sizes, the last one is the original */
+	const nlohmann::json &original = file.is_array() ? file.back() : file;
+	if (!original.is_object() || !original.count("file_id") || !original["file_id"].is_string()) return fallback;
+	return original["file_id"];
+}
+BroadcastReport Telegrab::broadcast(content message, std::istream &chat_ids, std::string checkpoint)
+{
+	/* One chat_id per line */
+	return broadcast(message, [&chat_ids](long long &chat_id)
+	{
+		return static_cast<bool>(chat_ids >> chat_id);
+	}, checkpoint);
+}
+BroadcastReport Telegrab::broadcast(content message, std::function<bool(long long&)> chat_id_source, std::string checkpoint)
+{
+	BroadcastReport report = {0, 0, 0};
+	std::string *media[] = {&message.photo, &message.video, &message.document, &message.audio, &message.sticker};
+	const char *media_names[] = {"photo", "video", "document", "audio", "sticker"};
+	/* Chats before this position in the source are done */
+	unsigned long long position = 0;
+
+	if (!checkpoint.empty())
+	{
+		std::ifstream file(checkpoint);
+		if (file.is_open())
+		{
+			nlohmann::json saved = nlohmann::json::parse(file, nullptr, false);
+			if (saved.is_object())
+			{
+				position = saved.value("position", 0ull);
+				report.delivered = saved.value("delivered", 0ull);
+				report.failed = saved.value("failed", 0ull);
+				report.blocked = saved.value("blocked", 0ull);
+				/* Files that have already been uploaded are sent by their file_id */
+				nlohmann::json uploaded = saved.value("media", nlohmann::json::object());
+				for (unsigned int i = 0; i < 5; i++)
+				{
+					*media[i] = uploaded.value(media_names[i], *media[i]);
+				}
+				nlohmann::json attachments = saved.value("attachments", nlohmann::json::array());
+				for (size_t i = 0; i < attachments.size() && i < message.attachments.size(); i++)
+				{
+					if (attachments[i].is_string()) message.attachments[i].media = attachments[i];
+				}
+				std::cout << "\tResuming the broadcast from the chat #" << position << "..." << std::endl;
+			}
+		}
+	}
+
+	long long chat_id;
+	for (unsigned long long i = 0; i < position; i++)
+	{
+		if (!chat_id_source(chat_id)) return report;
+	}
+
+	/* Local files are uploaded with the first delivered message only */
+	bool uploaded = true;
+	for (unsigned int i = 0; i < 5; i++)
+	{
+		std::ifstream file(*media[i]);
+		if (file.is_open()) uploaded = false;
+	}
+	for (const auto& attachment:message.attachments)
+	{
+		std::ifstream file(attachment.media);
+		if (file.is_open()) uploaded = false;
+	}
+
+	std::mutex state_mtx, source_mtx, limiter_mtx;
+	std::map<unsigned long long, int> done_ahead;
+	unsigned long long next = position, since_saved = 0;
+	bool exhausted = false;
+	std::chrono::steady_clock::time_point slot = std::chrono::steady_clock::now();
+	std::chrono::steady_clock::duration spacing = std::chrono::microseconds(1000000 / (broadcastRate > 0 ? broadcastRate : 1));
+
+	/* Must be called with state_mtx locked */
+	auto save = [&]()
+	{
+		if (checkpoint.empty()) return;
+		nlohmann::json saved;
+		saved["position"] = position;
+		saved["delivered"] = report.delivered;
+		saved["failed"] = report.failed;
+		saved["blocked"] = report.blocked;
+		saved["media"] = nlohmann::json::object();
+		for (unsigned int i = 0; i < 5; i++)
+		{
+			if (!media[i]->empty()) saved["media"][media_names[i]] = *media[i];
+		}
+		saved["attachments"] = nlohmann::json::array();
+		for (const auto& attachment:message.attachments)
+		{
+			saved["attachments"].push_back(attachment.media);
+		}
+		std::ofstream file(checkpoint + ".tmp", std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+		if (file.is_open())
+		{
+			file << saved;
+			file.close();
+			std::rename((checkpoint + ".tmp").c_str(), checkpoint.c_str());
+		}
+		else std::cerr << "\t| Error! Can't save the broadcast checkpoint to " << checkpoint << "." << std::endl;
+	};
+	/* Chats finish out of order, the checkpoint only moves past the ones that are all done */
+	auto complete = [&](unsigned long long seq, int outcome)
+	{
+		std::lock_guard<std::mutex> lock(state_mtx);
+		done_ahead[seq] = outcome;
+		while (!done_ahead.empty() && done_ahead.begin()->first == position)
+		{
+			switch (done_ahead.begin()->second)
+			{
+				case 0: report.delivered++; break;
+				case 1: report.failed++; break;
+				case 2: report.blocked++; break;
+			}
+			done_ahead.erase(done_ahead.begin());
+			position++;
+		}
+		if (++since_saved >= 100)
+		{
+			save();
+			since_saved = 0;
+		}
+	};
+	auto waitForSlot = [&]()
+	{
+		std::unique_lock<std::mutex> lock(limiter_mtx);
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		if (slot < now) slot = now;
+		std::chrono::steady_clock::time_point mine = slot;
+		slot += spacing;
+		lock.unlock();
+		std::this_thread::sleep_until(mine);
+	};
+	/* Returns 0 if delivered, 1 if failed, 2 if blocked */
+	auto attempt = [&](const content &msg, long long chat_id, std::vector<SendResult> &results) -> int
+	{
+		for (unsigned int retry = 0; ; retry++)
+		{
+			waitForSlot();
+			results.clear();
+			deliver(msg, chat_id, 0, Priority::Bulk, &results);
+
+			const SendResult *failure = nullptr;
+			for (const auto& result:results)
+			{
+				if (result.code != CURLE_OK || result.http_code != 200)
+				{
+					failure = &result;
+					break;
+				}
+			}
+			if (!failure) return 0;
+			if (failure->http_code == 403) return 2;
+
+			/* Part of the message has already been delivered, so retrying would duplicate it */
+			bool retryable = failure->code != CURLE_OK || failure->http_code == 429 || failure->http_code >= 500;
+			if (failure != &results.front() || !retryable || retry >= 3) return 1;
+
+			if (failure->http_code == 429)
+			{
+				nlohmann::json response = nlohmann::json::parse(failure->response, nullptr, false);
+				unsigned int retry_after = 1;
+				if (response.is_object() && response.count("parameters") != 0)
+				{
+					retry_after = response["parameters"].value("retry_after", 1u);
+				}
+				std::cerr << "\t| Error! Too many requests. Pausing the broadcast for " << retry_after << " seconds..." << std::endl;
+				std::lock_guard<std::mutex> lock(limiter_mtx);
+				std::chrono::steady_clock::time_point resume = std::chrono::steady_clock::now() + std::chrono::seconds(retry_after);
+				if (slot < resume) slot = resume;
+			}
+			else
+			{
+				std::this_thread::sleep_for(std::chrono::seconds(1 << retry));
+			}
+		}
+	};
+	auto take = [&](long long &chat_id, unsigned long long &seq)
+	{
+		std::lock_guard<std::mutex> lock(source_mtx);
+		if (exhausted || !chat_id_source(chat_id))
+		{
+			exhausted = true;
+			return false;
+		}
+		seq = next++;
+		return true;
+	};
+
+	std::cout << "\tBroadcasting a message..." << std::endl;
+
+	std::vector<SendResult> results;
+	unsigned long long seq;
+	while (!uploaded && take(chat_id, seq))
+	{
+		int outcome = attempt(message, chat_id, results);
+		if (outcome == 0)
+		{
+			/* Attachments are sent first, in order, and an album returns its messages in the same order */
+			size_t item = 0;
+			auto nextAttachment = [&]() -> Attachment*
+			{
+				while (item < message.attachments.size() && attachmentType(message.attachments[item].type) == 0) item++;
+				return item < message.attachments.size() ? &message.attachments[item++] : nullptr;
+			};
+			for (const auto& result:results)
+			{
+				nlohmann::json response = nlohmann::json::parse(result.response, nullptr, false);
+				if (!response.is_object() || response.count("result") == 0) continue;
+				const nlohmann::json &sent = response["result"];
+				std::lock_guard<std::mutex> lock(state_mtx);
+				if (result.type == 6 && sent.is_array())
+				{
+					for (const auto& part:sent)
+					{
+						Attachment *attachment = nextAttachment();
+						if (attachment) attachment->media = sentFileId(part, attachment->type, attachment->media);
+					}
+					continue;
+				}
+				Attachment *attachment = nextAttachment();
+				if (attachment) attachment->media = sentFileId(sent, attachment->type, attachment->media);
+				else if (result.type >= 1 && result.type <= 5) *media[result.type - 1] = sentFileId(sent, media_names[result.type - 1], *media[result.type - 1]);
+			}
+			uploaded = true;
+		}
+		complete(seq, outcome);
+	}
+
+	std::vector<std::thread> senders;
+	for (unsigned int i = 0; i < (broadcastSenders > 0 ? broadcastSenders : 1); i++)
+	{
+		senders.emplace_back([&]()
+		{
+			long long chat_id;
+			unsigned long long seq;
+			std::vector<SendResult> results;
+			while (take(chat_id, seq))
+			{
+				complete(seq, attempt(message, chat_id, results));
+			}
+		});
+	}
+	for (auto& sender:senders)
+	{
+		sender.join();
+	}
+
+	std::lock_guard<std::mutex> lock(state_mtx);
+	save();
+	std::cout << "\tBroadcast finished: " << report.delivered << " delivered, " << report.failed << " failed, " << report.blocked << " blocked." << std::endl;
+	return report;
+}
+void Telegrab::work()
+{
+	ClusterWorker worker(clusterAddress, clusterName, clusterLanes, [this](Update update)
+	{
+		Instructions(std::move(update));
+	}, drainTimeout);
+	while (!stopRequested)
+	{
+		if (!worker.serve(stopRequested))
+		{
+			std::cerr << "\t| Error! Can't connect to " << clusterAddress << ". Reconnecting in " << retryTimeout << " seconds..." << std::endl;
+			pause(std::chrono::seconds(retryTimeout));
+		}
+		else pause(std::chrono::milliseconds(500));
+		saveSessions(false);
+	}
+	saveSessions(true);
+	std::cout << "\tStopped." << std::endl;
+}
 void Telegrab::start()
 {
-	if (!fatalError)
+	if (!fatalError && clusterRole == "worker")
+	{
+		work();
+	}
+	else if (!fatalError)
 	{
+		restore();
 		std::cout << "\tChecking for updates..." << std::endl;
-		while (true)
+		while (!stopRequested)
 		{
 			if (!waitForUpdates())
 			{
-				std::cerr << "\t| Error! Failed to connect. Reconnecting in " << retryTimeout << " seconds..." << std::endl;
-				if (retryTimeout > 0)
+				poller->failure();
+				PollingStats stats = poller->stats();
+				if (stats.breaker == Breaker::Open)
 				{
-					std::this_thread::sleep_for(std::chrono::seconds(retryTimeout));
-					std::cout << "\tChecking for updates..." << std::endl;
+					std::cerr << "\t| Error! Failed to connect " << stats.failures << " times in a row. Pausing for " << stats.delay / 1000.0 << " seconds..." << std::endl;
 				}
+				else std::cerr << "\t| Error! Failed to connect. Reconnecting in " << stats.delay / 1000.0 << " seconds..." << std::endl;
 			}
-			if (interval > 0)
+			saveSessions(false);
+			std::chrono::milliseconds delay = poller->delay();
+			if (delay.count() > 0 && pause(delay))
 			{
-				std::this_thread::sleep_for(std::chrono::seconds(interval));
 				std::cout << "\tChecking for updates..." << std::endl;
 			}
 		}
+		drain();
+	}
+}
+void Telegrab::stop()
+{
+	/* Only sets a flag, so it may be called from a signal handler */
+	stopRequested = true;
+}
+bool Telegrab::cancelled() const
+{
+	return handlersCancelled;
+}
+int Telegrab::abortOnStop(void *bot, curl_off_t, curl_off_t, curl_off_t, curl_off_t)
+{
+	return static_cast<Telegrab*>(bot)->stopRequested ? 1 : 0;
+}
+/* Sleeps unless stop() is called. Returns false if it was */
+bool Telegrab::pause(std::chrono::milliseconds delay)
+{
+	std::chrono::steady_clock::time_point until = std::chrono::steady_clock::now() + delay;
+	while (!stopRequested && std::chrono::steady_clock::now() < until)
+	{
+		std::this_thread::sleep_for(std::min<std::chrono::steady_clock::duration>(until - std::chrono::steady_clock::now(), std::chrono::milliseconds(100)));
+	}
+	return !stopRequested;
+}
+/* Takes over from the previous process: its offset and the updates it didn't finish */
+void Telegrab::restore()
+{
+	std::vector<std::string> left;
+	if (!stateFile.empty())
+	{
+		std::ifstream file(stateFile);
+		if (file.is_open())
+		{
+			nlohmann::json state = nlohmann::json::parse(file, nullptr, false);
+			file.close();
+			if (state.is_object())
+			{
+				last_update_id = std::max(last_update_id, state.value("offset", 0u));
+				for (const auto& update:state.value("pending", nlohmann::json::array())) left.push_back(update.dump());
+			}
+			remove(stateFile.c_str());
+		}
+	}
+	if (!left.empty())
+	{
+		std::cout << "\t" << left.size() << " updates left by the previous run, handling them again..." << std::endl;
+		resume(left);
+	}
+	if (handoffAddress.empty()) return;
+
+	/* Ask the running process to stop polling, it answers with its offset and sends the updates it couldn't finish once it has drained */
+	int fd = cluster::open(handoffAddress, false);
+	if (fd != -1)
+	{
+		std::cout << "\tTaking over from the running process..." << std::endl;
+		std::string in;
+		static const char request[] = "{\"handoff\":true}\n";
+		char buffer[65536];
+		ssize_t n = 0;
+		if (cluster::sendAll(fd, request, sizeof(request) - 1))
+		{
+			while (in.find('\n') == std::string::npos && (n = recv(fd, buffer, sizeof(buffer), 0)) > 0) in.append(buffer, n);
+		}
+		size_t end = in.find('\n');
+		if (end == std::string::npos)
+		{
+			std::cerr << "\t| Error! The running process didn't hand over." << std::endl;
+			close(fd);
+		}
+		else
+		{
+			nlohmann::json answer = nlohmann::json::parse(in.substr(0, end), nullptr, false);
+			if (answer.is_object()) last_update_id = std::max(last_update_id, answer.value("offset", 0u));
+			in.erase(0, end + 1);
+			takeoverThread = std::thread([this, fd, in]() mutable
+			{
+				char buffer[65536];
+				ssize_t n;
+				while ((n = recv(fd, buffer, sizeof(buffer), 0)) > 0) in.append(buffer, n);
+				close(fd);
+				nlohmann::json rest = nlohmann::json::parse(in, nullptr, false);
+				std::vector<std::string> left;
+				if (rest.is_object())
+				{
+					for (const auto& update:rest.value("pending", nlohmann::json::array())) left.push_back(update.dump());
+				}
+				if (!left.empty())
+				{
+					std::cout << "\t" << left.size() << " updates handed over by the previous process." << std::endl;
+					resume(left);
+				}
+			});
+		}
+	}
+
+	/* The previous process closes its listener once it has accepted us, it may take a moment */
+	int listener = cluster::open(handoffAddress, true);
+	for (unsigned int attempt = 1; listener == -1 && attempt <= 5; attempt++)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(100 * attempt));
+		listener = cluster::open(handoffAddress, true);
+	}
+	if (listener == -1)
+	{
+		std::cerr << "\t| Error! Can't listen on " << handoffAddress << "." << std::endl;
+		return;
+	}
+	handoffListener = listener;
+	handoffThread = std::thread([this, listener]()
+	{
+		int fd;
+		while ((fd = accept(listener, nullptr, nullptr)) == -1 && errno == EINTR) {}
+		if (fd == -1) return;
+		char request[256];
+		if (recv(fd, request, sizeof(request), 0) <= 0)
+		{
+			close(fd);
+			return;
+		}
+		std::cout << "\tAnother process is taking over." << std::endl;
+		/* The address goes to the successor right away, so it can listen on it for the next one */
+		if (handoffListener.exchange(-1) != -1) close(listener);
+		successor = fd;
+		stopRequested = true;
+	});
+}
+void Telegrab::resume(const std::vector<std::string> &updates)
+{
+	std::string batch = "{\"ok\":true,\"result\":[";
+	for (size_t i = 0; i < updates.size(); i++)
+	{
+		if (i > 0) batch += ',';
+		batch += updates[i];
+	}
+	batch += "]}";
+	std::shared_ptr<nlohmann::json> file = std::make_shared<nlohmann::json>(nlohmann::json::parse(batch, nullptr, false));
+	if (file->is_discarded()) return;
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	handleUpdates(file, (*file)["result"], now, now, now);
+}
+/* Confirms the received updates up to the given one to Telegram, so nobody gets them again */
+void Telegrab::commitOffset(unsigned int last)
+{
+	if (last == 0) return;
+	CURL *curl = CurlInit();
+	if (!curl) return;
+	std::string buffer;
+	RequestBody &body = requestBody();
+	body.add("offset", (long long)last + 1).add("limit", 1LL).add("timeout", 0LL);
+	curl_easy_setopt(curl, CURLOPT_URL, apiUrl("getUpdates"));
+	setBody(curl, body);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, &buffer);
+	if (curl_easy_perform(curl) != CURLE_OK)
+	{
+		std::cerr << "\t| Error! Can't confirm the received updates." << std::endl;
+	}
+	curl_easy_cleanup(curl);
+}
+/* Stops after stop(): hands the polling over or confirms the offset, waits for the handlers until the deadline
+and hands over (or saves) the updates that are still not finished */
+void Telegrab::drain()
+{
+	std::cout << "\tStopping..." << std::endl;
+	int next = successor;
+	/* With nowhere to keep the unfinished updates, they are left to Telegram: the offset is confirmed after the handlers, up to the first of them */
+	bool keep = next != -1 || !stateFile.empty();
+	if (next != -1)
+	{
+		std::string answer = nlohmann::json{{"offset", last_update_id}}.dump() + "\n";
+		cluster::sendAll(next, answer.data(), answer.size());
+	}
+	else if (keep) commitOffset(last_update_id);
+	/* Updates still being handed over by the previous process are ours to finish or to pass on */
+	if (takeoverThread.joinable()) takeoverThread.join();
+
+	std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::seconds(drainTimeout);
+	while ((dispatcher ? dispatcher->backlog() : handlersRunning.load()) > 0 && std::chrono::steady_clock::now() < deadline)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	}
+	/* Handlers that haven't started by now don't start, their updates are handed over or saved. The running ones
+	get `grace` more seconds to see cancelled() and return, after that their updates are passed on too and may be handled twice */
+	handlersCancelled = true;
+	if (!dispatcher)
+	{
+		if (handlersRunning > 0) std::cout << "\tWaiting for " << handlersRunning << " handlers to return..." << std::endl;
+		std::chrono::steady_clock::time_point limit = std::chrono::steady_clock::now() + std::chrono::seconds(drainGrace);
+		while (handlersRunning > 0 && std::chrono::steady_clock::now() < limit)
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(20));
+		}
+		joinHandlers(false);
+		std::lock_guard<std::mutex> lock(inflightMtx);
+		if (!handling.empty())
+		{
+			/* They still use the bot, so the destructor waits for them */
+			std::cerr << "\t| Error! Handlers of the updates";
+			for (unsigned int update_id:handling) std::cerr << " " << update_id;
+			std::cerr << " didn't return, abandoning them." << std::endl;
+		}
+	}
+
+	nlohmann::json left = nlohmann::json::array();
+	if (dispatcher)
+	{
+		for (const auto& update:dispatcher->shutdown()) left.push_back(nlohmann::json::parse(update, nullptr, false));
+	}
+	else
+	{
+		std::lock_guard<std::mutex> lock(inflightMtx);
+		for (const auto& entry:inflight) left.push_back(entry.second.json());
+	}
+
+	if (next != -1)
+	{
+		std::string rest = nlohmann::json{{"pending", left}}.dump();
+		cluster::sendAll(next, rest.data(), rest.size());
+		close(next);
+	}
+	else if (!stateFile.empty())
+	{
+		std::ofstream file(stateFile, std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+		file << nlohmann::json{{"offset", last_update_id}, {"pending", left}};
+		if (!file.good()) std::cerr << "\t| Error! Can't write " << stateFile << "." << std::endl;
+	}
+	else
+	{
+		unsigned int confirmed = last_update_id;
+		for (const auto& update:left)
+		{
+			unsigned int update_id = update.is_object() ? update.value("update_id", 0u) : 0;
+			if (update_id != 0) confirmed = std::min(confirmed, update_id - 1);
+		}
+		commitOffset(confirmed);
+		if (!left.empty()) std::cerr << "\t| Error! " << left.size() << " updates were not finished in time, Telegram will send them again." << std::endl;
 	}
+	saveSessions(true);
+	std::cout << "\tStopped." << std::endl;
 }
@@ -0,0 +1,124 @@
+#include "telegrab.hpp"
+
+/* Rolling restart over a tcp: handoff address. A running bot hands polling over to a new copy,
+which must then listen on the same address for the next one. Exits with 1 on failure */
+
+void Telegrab::Instructions(Update)
+{
+}
+
+/* Bot API stand-in: every request gets an empty successful answer */
+static void serve(int listener, std::atomic<bool> &stopping)
+{
+	while (!stopping)
+	{
+		struct pollfd ready = {listener, POLLIN, 0};
+		if (poll(&ready, 1, 100) <= 0) continue;
+		int fd = accept(listener, nullptr, nullptr);
+		if (fd == -1) continue;
+		std::string request;
+		char buffer[4096];
+		ssize_t n;
+		size_t end;
+		while ((end = request.find("\r\n\r\n")) == std::string::npos && (n = recv(fd, buffer, sizeof(buffer), 0)) > 0) request.append(buffer, n);
+		if (end != std::string::npos)
+		{
+			size_t length = 0, header = request.find("Content-Length: ");
+			if (header != std::string::npos && header < end) length = strtoul(request.c_str() + header + 16, nullptr, 10);
+			while (request.size() < end + 4 + length && (n = recv(fd, buffer, sizeof(buffer), 0)) > 0) request.append(buffer, n);
+			/* getUpdates would normally wait for updates */
+			if (request.find("getUpdates") != std::string::npos) std::this_thread::sleep_for(std::chrono::milliseconds(50));
+			std::string body = "{\"ok\":true,\"result\":[]}";
+			std::string answer = "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nConnection: close\r\nContent-Length: " + std::to_string(body.size()) + "\r\n\r\n";
+			if (request.compare(0, 4, "HEAD") != 0) answer += body;
+			cluster::sendAll(fd, answer.data(), answer.size());
+		}
+		close(fd);
+	}
+}
+
+/* A free local TCP port */
+static unsigned int freePort(int &listener)
+{
+	listener = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t size = sizeof(addr);
+	if (bind(listener, (struct sockaddr*)&addr, sizeof(addr)) != 0 || ::listen(listener, 16) != 0 || getsockname(listener, (struct sockaddr*)&addr, &size) != 0) return 0;
+	return ntohs(addr.sin_port);
+}
+
+/* Asks whoever listens on the address to hand over, returns its answer */
+static std::string takeOver(const std::string &address)
+{
+	int fd = cluster::open(address, false);
+	if (fd == -1) return "";
+	static const char request[] = "{\"handoff\":true}\n";
+	std::string in;
+	char buffer[4096];
+	ssize_t n;
+	if (cluster::sendAll(fd, request, sizeof(request) - 1))
+	{
+		while ((n = recv(fd, buffer, sizeof(buffer), 0)) > 0) in.append(buffer, n);
+	}
+	close(fd);
+	return in;
+}
+
+int main()
+{
+	mkdir("downloads", S_IRWXU);
+	int api, handoff;
+	unsigned int api_port = freePort(api), handoff_port = freePort(handoff);
+	close(handoff);
+	if (api_port == 0 || handoff_port == 0)
+	{
+		std::cerr << "\t| Error! Can't listen on a local port." << std::endl;
+		return 1;
+	}
+	std::atomic<bool> stopping(false);
+	std::thread server(serve, api, std::ref(stopping));
+
+	std::string address = "tcp:127.0.0.1:" + std::to_string(handoff_port);
+	nlohmann::json config = {
+		{"token", "123456:TEST"},
+		{"api", "http://127.0.0.1:" + std::to_string(api_port)},
+		{"polling", {{"limit", 100}, {"interval", 0}, {"timeout", 0}, {"retryTimeout", 1}}},
+		{"outbound", {{"warm", 0}}},
+		{"shutdown", {{"deadline", 1}, {"state", ""}, {"handoff", address}}}
+	};
+	std::ofstream("handoff_test.json") << config.dump();
+
+	bool ok = true;
+	{
+		std::unique_ptr<Telegrab> old(new Telegrab("handoff_test.json"));
+		std::thread running([&old]() { old->start(); });
+		std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+		/* The new copy takes over, the old one stops and exits */
+		Telegrab bot("handoff_test.json");
+		std::thread taking([&bot]() { bot.start(); });
+		running.join();
+		old.reset();
+		std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+		/* The new copy must be listening on the same address for the next deploy */
+		std::string answer = takeOver(address);
+		if (answer.find("\"offset\"") == std::string::npos)
+		{
+			std::cerr << "\t| Error! The new process doesn't listen on " << address << "." << std::endl;
+			ok = false;
+			bot.stop();
+		}
+		taking.join();
+	}
+
+	stopping = true;
+	server.join();
+	close(api);
+	remove("handoff_test.json");
+	std::cout << (ok ? "\tPassed." : "\tFailed.") << std::endl;
+	return ok ? 0 : 1;
+}